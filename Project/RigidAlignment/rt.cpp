@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Dense>
+#include "projective_correspondence.h"
 
 using namespace Eigen;
 using namespace cv;
@@ -102,7 +103,14 @@ int main() {
     RigidAlignment(source, target, R, T);
 
     //3d points *RT
+    // The organized grid keeps every pixel (NaN where there is no depth) plus K and scale/R/T,
+    // so the optimizer can project FLAME vertices back into the image (projective association)
     std::vector<Vertex> cloud;
+    OrganizedDepthGrid grid(depth.cols, depth.rows);
+    grid.K = K;
+    grid.scale = scale;
+    grid.R = R;
+    grid.T = T;
     for (int y = 0; y < depth.rows; ++y) {
         for (int x = 0; x < depth.cols; ++x) {
             ushort d_raw = depth.at<ushort>(y, x);
@@ -118,6 +126,7 @@ int main() {
             p = R * p + T;
             Vertex v;
             v.position = p.cast<float>();
+            grid.points[size_t(y) * depth.cols + x] = v.position;
 
             Vec3b rgb = color.at<Vec3b>(y, x);
             v.color = Vector4i(rgb[2], rgb[1], rgb[0], 255);
@@ -141,5 +150,11 @@ int main() {
     }
 
     std::cout << "Saved transformed point cloud with color: " << filename << "\n";
+
+    // Same valid pixels in the same row-major order as the OFF above
+    grid.index_valid_pixels();
+    std::string gridFilename = "../model/mesh/" + frame + "/organized_" + frame + ".grid";
+    grid.save(gridFilename);
+    std::cout << "Saved organized depth grid: " << gridFilename << "\n";
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <cmath>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "correspondence.h"
+
+// Benchmark of the bounded-radius correspondence search: brute force (scalar, AVX2 and AVX-512
+// kernels), the nanoflann KD-tree and the voxel hash grid, on synthetic scans of 100k-300k points
+// and optionally on a real scan, plus the warm-started search over several rounds of slowly moving
+// queries and the recall/speed trade-off of the approximate KD-tree search. Every mode is checked
+// against the scalar brute force: a match counts as wrong if its distance differs by more than float
+// rounding (the modes sum the squared coordinates in different orders).
+
+using namespace std;
+using namespace Eigen;
+
+static const float MAX_DISTANCE = 0.005f;   // optimize_plane uses 0.005, optimize 0.02
+static const int NUM_QUERIES = 5023;        // FLAME vertices
+static const int ROUNDS = 5;                // ICP rounds timed per mode
+static const float QUERY_NOISE = 0.003f;    // offset of the queries from the surface
+static const float ROUND_DRIFT = 0.0001f;   // per-axis movement of the queries between warm-start rounds
+static const float WARM_START_SLACK = 0.0005f;
+static const vector<float> EPS_VALUES = {0.0f, 0.1f, 0.25f, 0.5f, 1.0f, 2.0f}; // approximate KD-tree sweep
+static const vector<int> SCAN_SIZES = {100000, 200000, 300000};
+static const string REAL_SCAN = "../data/face/00001_transform_onlyface.off"; // skipped if missing
+
+MatrixXf load_off_as_matrix(const std::string& filename) {
+    std::ifstream in(filename);
+    if (!in.is_open()) throw std::runtime_error("Cannot open file: " + filename);
+
+    std::string header;
+    in >> header;
+    if (header != "OFF" && header != "COFF") throw std::runtime_error("Not an OFF/COFF file");
+
+    int numVertices, numFaces, dummy;
+    in >> numVertices >> numFaces >> dummy;
+
+    MatrixXf mat(3, numVertices);
+    for (int i = 0; i < numVertices; ++i) {
+        in >> mat(0, i) >> mat(1, i) >> mat(2, i);
+        if (header == "COFF") {
+            int r, g, b, a;
+            in >> r >> g >> b >> a;
+        }
+    }
+    return mat;
+}
+
+// Face-sized curved patch (about 0.2 x 0.25 m) sampled uniformly, like the transformed depth points
+MatrixXf synthetic_scan(int n, std::mt19937& rng) {
+    std::uniform_real_distribution<float> ux(-0.1f, 0.1f), uy(-0.12f, 0.13f);
+    MatrixXf scan(3, n);
+    for (int i = 0; i < n; ++i) {
+        const float x = ux(rng), y = uy(rng);
+        scan.col(i) << x, y, 0.08f - 4.0f * x * x - 1.5f * y * y + 0.01f * std::sin(40.0f * x) * std::cos(30.0f * y);
+    }
+    return scan;
+}
+
+// Queries near random scan points, like FLAME vertices close to the scan after rigid alignment
+MatrixXf perturbed_queries(const MatrixXf& scan, int m, std::mt19937& rng) {
+    std::uniform_int_distribution<int> pick(0, int(scan.cols()) - 1);
+    std::normal_distribution<float> noise(0.0f, QUERY_NOISE);
+    MatrixXf queries(3, m);
+    for (int i = 0; i < m; ++i)
+        queries.col(i) = scan.col(pick(rng)) + Vector3f(noise(rng), noise(rng), noise(rng));
+    return queries;
+}
+
+static int count_mismatches(const NNBatchResult& result, const NNBatchResult& reference) {
+    int wrong = 0;
+    for (size_t i = 0; i < reference.valid.size(); ++i) {
+        if (result.valid[i] != reference.valid[i]) ++wrong;
+        else if (reference.valid[i] &&
+                 std::abs(result.squaredDistances[i] - reference.squaredDistances[i]) > 1e-5f * reference.squaredDistances[i]) ++wrong;
+    }
+    return wrong;
+}
+
+static void run_all(const string& name, const MatrixXf& scan, const MatrixXf& queries) {
+    cout << name << ": " << scan.cols() << " target points, " << queries.cols() << " queries, "
+         << omp_get_max_threads() << " threads" << endl;
+
+    // The scalar brute-force kernel is the reference, the SIMD ones must agree with it
+    struct Run { CorrespondenceMode mode; SimdLevel simd; };
+    const Run runs[] = {
+        {CorrespondenceMode::BruteForce, SimdLevel::Scalar}, {CorrespondenceMode::BruteForce, SimdLevel::AVX2},
+        {CorrespondenceMode::BruteForce, SimdLevel::AVX512}, {CorrespondenceMode::KDTree, SimdLevel::Best},
+        {CorrespondenceMode::VoxelHash, SimdLevel::Best},
+    };
+    NNBatchResult reference;
+    for (const Run& run : runs) {
+        const CorrespondenceMode mode = run.mode;
+        if (mode == CorrespondenceMode::BruteForce && run.simd != SimdLevel::Scalar &&
+            SoATargetCloud::resolve(run.simd) != run.simd) continue; // not supported by this CPU
+        const string label = mode == CorrespondenceMode::BruteForce ? string("brute force ") + simd_level_name(run.simd) :
+                             mode == CorrespondenceMode::KDTree ? "kd-tree" : "voxel hash";
+
+        // The voxel grid is built by the first match(), so build time is the engine plus one query
+        double t0 = omp_get_wtime();
+        CorrespondenceEngine engine(mode, scan);
+        engine.set_simd_level(run.simd);
+        NNBatchResult result = engine.match(queries, MAX_DISTANCE);
+        const double build = omp_get_wtime() - t0;
+
+        const int rounds = mode == CorrespondenceMode::BruteForce ? 1 : ROUNDS;
+        t0 = omp_get_wtime();
+        for (int r = 0; r < rounds; ++r) result = engine.match(queries, MAX_DISTANCE);
+        const double query = (omp_get_wtime() - t0) / rounds;
+
+        if (mode == CorrespondenceMode::BruteForce && run.simd == SimdLevel::Scalar) reference = result;
+        cout << "  " << label << ": first round " << build * 1e3 << " ms, per round " << query * 1e3 << " ms, "
+             << result.num_valid() << " matched, " << count_mismatches(result, reference) << " differ from brute force" << endl;
+    }
+}
+
+// Later ICP rounds: the vertices drift a little each round. Cold KD-tree queries against the engine
+// with warm start, which must give the same matches.
+static void run_warm(const MatrixXf& scan, MatrixXf queries, std::mt19937& rng) {
+    std::normal_distribution<float> drift(0.0f, ROUND_DRIFT);
+    CorrespondenceEngine cold(CorrespondenceMode::KDTree, scan);
+    CorrespondenceEngine warm(CorrespondenceMode::KDTree, scan);
+    warm.enable_warm_start(WARM_START_SLACK);
+
+    double coldTime = 0.0, warmTime = 0.0;
+    int wrong = 0, hits = 0;
+    for (int r = 0; r <= ROUNDS; ++r) {
+        if (r > 0) queries += MatrixXf::NullaryExpr(3, queries.cols(), [&]() { return drift(rng); });
+        double t0 = omp_get_wtime();
+        const NNBatchResult reference = cold.match(queries, MAX_DISTANCE);
+        const double t1 = omp_get_wtime();
+        const NNBatchResult result = warm.match(queries, MAX_DISTANCE);
+        const double t2 = omp_get_wtime();
+        // Round 0 fills the candidate lists
+        if (r == 0) continue;
+        coldTime += t1 - t0;
+        warmTime += t2 - t1;
+        wrong += count_mismatches(result, reference);
+        hits += warm.warm_hits();
+    }
+    cout << "  warm start (slack " << WARM_START_SLACK << ", drift " << ROUND_DRIFT << " per round): kd-tree "
+         << coldTime / ROUNDS * 1e3 << " ms, warm " << warmTime / ROUNDS * 1e3 << " ms per round, "
+         << hits / ROUNDS << " cached per round, " << wrong << " differ" << endl;
+}
+
+// Approximate KD-tree search: time per round and recall against the exact search for every eps
+static void run_eps(const MatrixXf& scan, const MatrixXf& queries) {
+    CorrespondenceEngine engine(CorrespondenceMode::KDTree, scan);
+    for (float eps : EPS_VALUES) {
+        engine.set_eps(eps);
+        NNBatchResult result = engine.match(queries, MAX_DISTANCE);
+        const double t0 = omp_get_wtime();
+        for (int r = 0; r < ROUNDS; ++r) result = engine.match(queries, MAX_DISTANCE);
+        const double query = (omp_get_wtime() - t0) / ROUNDS;
+        cout << "  kd-tree eps " << eps << ": per round " << query * 1e3 << " ms, recall "
+             << engine.measure_recall(queries, MAX_DISTANCE, result) << endl;
+    }
+}
+
+int main() {
+    std::mt19937 rng(42);
+    for (int n : SCAN_SIZES) {
+        const MatrixXf scan = synthetic_scan(n, rng);
+        const MatrixXf queries = perturbed_queries(scan, NUM_QUERIES, rng);
+        run_all("synthetic", scan, queries);
+        run_warm(scan, queries, rng);
+        run_eps(scan, queries);
+    }
+    if (std::ifstream(REAL_SCAN).good()) {
+        const MatrixXf scan = load_off_as_matrix(REAL_SCAN);
+        run_all(REAL_SCAN, scan, perturbed_queries(scan, NUM_QUERIES, rng));
+    }
+    return 0;
+}
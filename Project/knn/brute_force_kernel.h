@@ -0,0 +1,200 @@
+#pragma once
+
+// Exhaustive nearest-neighbour kernel for validation runs and small target clouds.
+// The target is stored as separate x/y/z float arrays, padded to a multiple of 16 points, so one
+// instruction computes the distances of 8 (AVX2) or 16 (AVX-512) target points to a query. Every
+// SIMD lane keeps its own running minimum and index in registers; the lanes are only reduced at the
+// end of a target block. Queries are processed in tiles of QUERY_TILE against blocks of TARGET_BLOCK
+// target points (24 KB), so one block stays in L1 while the whole tile is compared against it.
+//
+// The instruction set is picked at run time from what the CPU supports; SimdLevel::Scalar is the
+// portable fallback and the reference for the vector paths.
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <omp.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BRUTE_FORCE_X86 1
+#include <immintrin.h>
+#endif
+
+enum class SimdLevel { Scalar, AVX2, AVX512, Best };
+
+inline SimdLevel detect_simd_level() {
+#ifdef BRUTE_FORCE_X86
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+#endif
+    return SimdLevel::Scalar;
+}
+
+inline const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512: return "AVX-512";
+        case SimdLevel::AVX2:   return "AVX2";
+        case SimdLevel::Scalar: return "scalar";
+        default:                return "best";
+    }
+}
+
+namespace brute_force_detail {
+
+// Nearest of the target points [begin, end) to q; end - begin is a multiple of 16. best/bestIndex
+// carry the running minimum across blocks, ties keep the lower index.
+using BlockKernel = void (*)(const float* xs, const float* ys, const float* zs, int begin, int end,
+                             const float* q, float& best, int& bestIndex);
+
+inline void nearest_in_block_scalar(const float* xs, const float* ys, const float* zs, int begin, int end,
+                                    const float* q, float& best, int& bestIndex) {
+    for (int j = begin; j < end; ++j) {
+        const float dx = xs[j] - q[0], dy = ys[j] - q[1], dz = zs[j] - q[2];
+        const float d = dx * dx + dy * dy + dz * dz;
+        if (d < best) { best = d; bestIndex = j; }
+    }
+}
+
+// Folds the per-lane minima into best/bestIndex
+inline void reduce_lanes(const float* laneBest, const int* laneIndex, int lanes, float& best, int& bestIndex) {
+    for (int l = 0; l < lanes; ++l) {
+        if (laneBest[l] < best || (laneBest[l] == best && laneIndex[l] < bestIndex && laneIndex[l] >= 0)) {
+            best = laneBest[l];
+            bestIndex = laneIndex[l];
+        }
+    }
+}
+
+#ifdef BRUTE_FORCE_X86
+__attribute__((target("avx2")))
+inline void nearest_in_block_avx2(const float* xs, const float* ys, const float* zs, int begin, int end,
+                                  const float* q, float& best, int& bestIndex) {
+    const __m256 qx = _mm256_set1_ps(q[0]), qy = _mm256_set1_ps(q[1]), qz = _mm256_set1_ps(q[2]);
+    __m256 laneBest = _mm256_set1_ps(best);
+    __m256i laneIndex = _mm256_set1_epi32(-1);
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(begin), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const __m256i step = _mm256_set1_epi32(8);
+    for (int j = begin; j < end; j += 8) {
+        const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs + j), qx);
+        const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys + j), qy);
+        const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs + j), qz);
+        const __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        const __m256 closer = _mm256_cmp_ps(d, laneBest, _CMP_LT_OQ);
+        laneBest = _mm256_min_ps(d, laneBest);
+        laneIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(laneIndex), _mm256_castsi256_ps(index), closer));
+        index = _mm256_add_epi32(index, step);
+    }
+    alignas(32) float bestOut[8];
+    alignas(32) int indexOut[8];
+    _mm256_store_ps(bestOut, laneBest);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(indexOut), laneIndex);
+    reduce_lanes(bestOut, indexOut, 8, best, bestIndex);
+}
+
+__attribute__((target("avx512f")))
+inline void nearest_in_block_avx512(const float* xs, const float* ys, const float* zs, int begin, int end,
+                                    const float* q, float& best, int& bestIndex) {
+    const __m512 qx = _mm512_set1_ps(q[0]), qy = _mm512_set1_ps(q[1]), qz = _mm512_set1_ps(q[2]);
+    __m512 laneBest = _mm512_set1_ps(best);
+    __m512i laneIndex = _mm512_set1_epi32(-1);
+    __m512i index = _mm512_add_epi32(_mm512_set1_epi32(begin),
+                                     _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    const __m512i step = _mm512_set1_epi32(16);
+    for (int j = begin; j < end; j += 16) {
+        const __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(xs + j), qx);
+        const __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(ys + j), qy);
+        const __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(zs + j), qz);
+        const __m512 d = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+        const __mmask16 closer = _mm512_cmp_ps_mask(d, laneBest, _CMP_LT_OQ);
+        laneBest = _mm512_min_ps(d, laneBest);
+        laneIndex = _mm512_mask_blend_epi32(closer, laneIndex, index);
+        index = _mm512_add_epi32(index, step);
+    }
+    alignas(64) float bestOut[16];
+    alignas(64) int indexOut[16];
+    _mm512_store_ps(bestOut, laneBest);
+    _mm512_store_si512(indexOut, laneIndex);
+    reduce_lanes(bestOut, indexOut, 16, best, bestIndex);
+}
+#endif
+
+} // namespace brute_force_detail
+
+class SoATargetCloud {
+public:
+    static constexpr int PADDING = 16;        // widest vector, in points
+    static constexpr int TARGET_BLOCK = 2048; // 3 x 2048 floats = 24 KB
+    static constexpr int QUERY_TILE = 64;
+
+    explicit SoATargetCloud(const Eigen::MatrixXf& target) : size_(int(target.cols())) {
+        // Padding points are infinitely far away and never win
+        const int padded = (size_ + PADDING - 1) / PADDING * PADDING;
+        xs_.assign(padded, std::numeric_limits<float>::infinity());
+        ys_.assign(padded, std::numeric_limits<float>::infinity());
+        zs_.assign(padded, std::numeric_limits<float>::infinity());
+        for (int j = 0; j < size_; ++j) {
+            xs_[j] = target(0, j);
+            ys_[j] = target(1, j);
+            zs_[j] = target(2, j);
+        }
+    }
+
+    int size() const { return size_; }
+
+    // Nearest target point of every column of queries within maxDistance (unbounded by default):
+    // indices[i] = -1 if there is none. squaredDistances may be null. A level the CPU does not
+    // support falls back to the best one it does.
+    void nearest(const Eigen::MatrixXf& queries, int* indices, float* squaredDistances = nullptr,
+                 float maxDistance = std::numeric_limits<float>::infinity(), SimdLevel level = SimdLevel::Best) const {
+        const brute_force_detail::BlockKernel kernel = select_kernel(level);
+        const int m = int(queries.cols());
+        const int padded = int(xs_.size());
+        // Inclusive radius: a point exactly at maxDistance still matches
+        const float limit = std::isinf(maxDistance) ? maxDistance
+                          : std::nextafter(maxDistance * maxDistance, std::numeric_limits<float>::infinity());
+        const int numTiles = (m + QUERY_TILE - 1) / QUERY_TILE;
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int tile = 0; tile < numTiles; ++tile) {
+            const int first = tile * QUERY_TILE, count = std::min(QUERY_TILE, m - first);
+            float best[QUERY_TILE];
+            int bestIndex[QUERY_TILE];
+            std::fill(best, best + count, limit);
+            std::fill(bestIndex, bestIndex + count, -1);
+
+            for (int begin = 0; begin < padded; begin += TARGET_BLOCK) {
+                const int end = std::min(begin + TARGET_BLOCK, padded);
+                for (int k = 0; k < count; ++k) {
+                    const float q[3] = { queries(0, first + k), queries(1, first + k), queries(2, first + k) };
+                    kernel(xs_.data(), ys_.data(), zs_.data(), begin, end, q, best[k], bestIndex[k]);
+                }
+            }
+            for (int k = 0; k < count; ++k) {
+                indices[first + k] = bestIndex[k];
+                if (squaredDistances) squaredDistances[first + k] = best[k];
+            }
+        }
+    }
+
+    // The level nearest() actually runs for a requested level
+    static SimdLevel resolve(SimdLevel level) {
+        const SimdLevel supported = detect_simd_level();
+        return level == SimdLevel::Best || level > supported ? supported : level;
+    }
+
+private:
+    static brute_force_detail::BlockKernel select_kernel(SimdLevel level) {
+        switch (resolve(level)) {
+#ifdef BRUTE_FORCE_X86
+            case SimdLevel::AVX512: return brute_force_detail::nearest_in_block_avx512;
+            case SimdLevel::AVX2:   return brute_force_detail::nearest_in_block_avx2;
+#endif
+            default:                return brute_force_detail::nearest_in_block_scalar;
+        }
+    }
+
+    int size_;
+    std::vector<float> xs_, ys_, zs_;
+};
@@ -0,0 +1,470 @@
+#pragma once
+
+// Correspondence search against the fixed target cloud of one ICP run.
+// The target (the transformed depth points) never changes between rounds, only the FLAME mesh
+// does, so the KD-tree over the target is built once and every round only queries it.
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "nanoflann.hpp"
+#include "projective_correspondence.h"
+#include "voxel_hash_grid.h"
+#include "brute_force_kernel.h"
+
+// How the optimizers find the nearest target point of every FLAME vertex
+enum class CorrespondenceMode {
+    BruteForce, // exhaustive search: O(V x N) per round, SIMD kernel over a structure-of-arrays copy
+    KDTree,     // TargetKDTree: built once per target, radius-bounded queries
+    Projective, // OrganizedDepthGrid: project each vertex into the depth image, search a pixel window
+    VoxelHash,  // TargetVoxelGrid: hash grid with cell size max_distance, at most 27 cells per query
+};
+
+// Result of a batch query: entry i belongs to query column i
+struct NNBatchResult {
+    std::vector<int>     indices;          // index into the target, -1 if not valid
+    std::vector<float>   squaredDistances; // squared distance to that target point
+    std::vector<uint8_t> valid;            // 1 if a target point was found within the radius
+
+    int num_valid() const { return int(std::count(valid.begin(), valid.end(), uint8_t(1))); }
+};
+
+// Fraction of the queries with an exact match for which approx found a nearest point too (a point
+// at the exact nearest distance, so ties count as hits)
+inline double match_recall(const NNBatchResult& approx, const NNBatchResult& exact) {
+    int relevant = 0, hits = 0;
+    for (size_t i = 0; i < exact.valid.size(); ++i) {
+        if (!exact.valid[i]) continue;
+        ++relevant;
+        hits += approx.valid[i] && approx.squaredDistances[i] <= exact.squaredDistances[i] * (1.0f + 1e-5f);
+    }
+    return relevant > 0 ? double(hits) / relevant : 1.0;
+}
+
+// Column order of points along a 3D Morton (Z-order) curve over their bounding box.
+// Consecutive queries in this order are spatially close, so they walk the same tree nodes and
+// target points while those are still in cache.
+inline std::vector<int> morton_order(const Eigen::MatrixXf& points) {
+    const int n = int(points.cols());
+    std::vector<int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    if (n == 0) return order;
+
+    const Eigen::Vector3f lo = points.rowwise().minCoeff();
+    const Eigen::Vector3f extent = (points.rowwise().maxCoeff() - lo).cwiseMax(1e-12f);
+
+    // 10 bits per axis, spread so that x, y and z bits interleave into a 30 bit code
+    auto spread = [](uint32_t v) {
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v << 8))  & 0x0300F00F;
+        v = (v | (v << 4))  & 0x030C30C3;
+        v = (v | (v << 2))  & 0x09249249;
+        return v;
+    };
+    std::vector<uint32_t> codes(n);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i) {
+        const Eigen::Vector3f q = ((points.col(i) - lo).cwiseQuotient(extent) * 1023.0f).cwiseMax(0.0f).cwiseMin(1023.0f);
+        codes[i] = spread(uint32_t(q.x())) | (spread(uint32_t(q.y())) << 1) | (spread(uint32_t(q.z())) << 2);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return codes[a] < codes[b]; });
+    return order;
+}
+
+// nanoflann adaptor over a 3 x N float matrix
+struct TargetCloudAdaptor {
+    const Eigen::MatrixXf& mat;
+
+    explicit TargetCloudAdaptor(const Eigen::MatrixXf& mat_) : mat(mat_) {}
+
+    inline size_t kdtree_get_point_count() const { return mat.cols(); }
+    inline float kdtree_get_pt(const size_t idx, const size_t dim) const { return mat(dim, idx); }
+    template <class BBOX>
+    bool kdtree_get_bbox(BBOX&) const { return false; }
+};
+
+class TargetKDTree {
+public:
+    using Index = nanoflann::KDTreeSingleIndexAdaptor<
+        nanoflann::L2_Simple_Adaptor<float, TargetCloudAdaptor>, TargetCloudAdaptor, 3, int>;
+
+    // Keeps its own copy of the target, so the tree stays valid independently of the caller's matrix.
+    // The build is split over buildThreads threads (0 = all OpenMP threads).
+    explicit TargetKDTree(const Eigen::MatrixXf& target, size_t leafSize = 10, int buildThreads = 0)
+      : points_(target), adaptor_(points_),
+        index_(3, adaptor_, nanoflann::KDTreeSingleIndexAdaptorParams(
+                   leafSize, nanoflann::KDTreeSingleIndexAdaptorFlags::None,
+                   unsigned(buildThreads > 0 ? buildThreads : omp_get_max_threads()))) {}
+
+    TargetKDTree(const TargetKDTree&) = delete;
+    TargetKDTree& operator=(const TargetKDTree&) = delete;
+
+    const Eigen::MatrixXf& points() const { return points_; }
+
+    // Nearest target point of one query within maxDistance. The radius bounds the search itself,
+    // so branches farther than maxDistance are never visited. Returns false if there is none.
+    bool nearest_within(const float* query, float maxDistance, int& index, float& squaredDistance) const {
+        return index_.rknnSearch(query, 1, &index, &squaredDistance, maxDistance * maxDistance) > 0;
+    }
+
+    // The target points within radius of one query, closest first, at most maxCount of them, with
+    // their squared distances. Returns false if there may be more than maxCount.
+    bool within(const float* query, float radius, int maxCount, std::vector<int>& indices, std::vector<float>& squaredDistances) const {
+        indices.resize(maxCount + 1);
+        squaredDistances.resize(maxCount + 1);
+        const int found = int(index_.rknnSearch(query, size_t(maxCount + 1), indices.data(), squaredDistances.data(), radius * radius));
+        indices.resize(std::min(found, maxCount));
+        squaredDistances.resize(indices.size());
+        return found <= maxCount;
+    }
+
+    // The k nearest target points of one query, closest first; returns how many were found
+    int knn(const float* query, int k, int* indices, float* squaredDistances) const {
+        return int(index_.knnSearch(query, size_t(k), indices, squaredDistances));
+    }
+
+    // Nearest target point of every column of queries (3 x M) within maxDistance (unbounded by default).
+    // Safe to call from any number of threads: the tree is only read, and every thread owns its
+    // result set. Queries are handed out in chunks of chunkSize so that threads that hit dense
+    // regions do not hold up the others; with mortonOrder the chunks are spatially coherent.
+    // eps > 0 makes the search approximate: branches that cannot hold a point closer than
+    // best / (1 + eps) are skipped, so a match may be up to (1 + eps) times farther than the nearest.
+    NNBatchResult query_batch(const Eigen::MatrixXf& queries,
+                              float maxDistance = std::numeric_limits<float>::infinity(),
+                              bool mortonOrder = false, int chunkSize = 256, float eps = 0.0f) const {
+        const int m = int(queries.cols());
+        NNBatchResult result;
+        result.indices.assign(m, -1);
+        result.squaredDistances.assign(m, std::numeric_limits<float>::infinity());
+        result.valid.assign(m, 0);
+
+        const std::vector<int> order = mortonOrder ? morton_order(queries) : std::vector<int>();
+        const float maxSquaredDistance = std::isinf(maxDistance) ? maxDistance : maxDistance * maxDistance;
+        const nanoflann::SearchParameters params(eps);
+
+        #pragma omp parallel
+        {
+            int index;
+            float squaredDistance;
+            nanoflann::RKNNResultSet<float, int> resultSet(1, maxSquaredDistance);
+
+            #pragma omp for schedule(dynamic, chunkSize)
+            for (int k = 0; k < m; ++k) {
+                const int i = mortonOrder ? order[k] : k;
+                const float query[3] = { queries(0, i), queries(1, i), queries(2, i) };
+                resultSet.init(&index, &squaredDistance);
+                index_.findNeighbors(resultSet, query, params);
+                if (resultSet.size() > 0) {
+                    result.indices[i] = index;
+                    result.squaredDistances[i] = squaredDistance;
+                    result.valid[i] = 1;
+                }
+            }
+        }
+        return result;
+    }
+
+    // For every column of source: index of its nearest target point within maxDistance, -1 if none
+    std::vector<int> nearest_within(const Eigen::MatrixXf& source, float maxDistance) const {
+        return query_batch(source, maxDistance, true).indices;
+    }
+
+private:
+    Eigen::MatrixXf points_;
+    TargetCloudAdaptor adaptor_;
+    Index index_;
+};
+
+// PCA normal of every target point from its neighbours nearest points, oriented towards
+// viewDirection (the FLAME frame faces +z, so does the camera that took the scan)
+inline std::vector<Eigen::Vector3f> estimate_target_normals(const TargetKDTree& tree, int neighbours,
+                                                            const Eigen::Vector3f& viewDirection = Eigen::Vector3f::UnitZ()) {
+    const Eigen::MatrixXf& target = tree.points();
+    const int n = int(target.cols());
+    std::vector<Eigen::Vector3f> normals(n);
+    #pragma omp parallel
+    {
+        std::vector<int> indices(neighbours);
+        std::vector<float> squaredDistances(neighbours);
+        #pragma omp for schedule(dynamic, 256)
+        for (int i = 0; i < n; ++i) {
+            const int found = tree.knn(target.col(i).data(), neighbours, indices.data(), squaredDistances.data());
+            Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+            for (int k = 0; k < found; ++k) mean += target.col(indices[k]);
+            mean /= float(std::max(found, 1));
+            Eigen::Matrix3f cov = Eigen::Matrix3f::Zero();
+            for (int k = 0; k < found; ++k) {
+                const Eigen::Vector3f d = target.col(indices[k]) - mean;
+                cov += d * d.transpose();
+            }
+            Eigen::Vector3f normal = Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f>(cov).eigenvectors().col(0);
+            if (normal.dot(viewDirection) < 0.0f) normal = -normal;
+            normals[i] = normal;
+        }
+    }
+    return normals;
+}
+
+// Correspondence search of one target cloud in the selected mode. The search structure is built
+// once in the constructor; match() is then called every ICP round with the current FLAME vertices.
+// Projective mode needs the organized grid that rt saved next to the point cloud (gridPath); its
+// valid pixels must be exactly the columns of target. VoxelHash mode builds its grid on the first
+// match() with the cell size set to maxDistance and only rebuilds it if a later call asks for a
+// larger radius; match() must then not be called concurrently.
+//
+// With enable_warm_start(slack) every vertex keeps a candidate list from the round in which it was
+// last searched in full: the target points within d + 2 * slack of its position c at that time,
+// d being its nearest distance then. While the vertex x stays within slack of c its new nearest
+// point q* is exact from that list alone, since
+//     |q* - c| <= |q* - x| + |x - c| <= (d + |x - c|) + |x - c| <= d + 2 * slack.
+// A vertex without a match keeps an empty list if nothing lies within maxDistance + slack of c.
+// Only vertices that moved farther are searched again, which also rebuilds their list; a vertex whose
+// ball holds more than WARM_MAX_CANDIDATES points is not cached. The lists are KD-tree radius queries,
+// so warm start is only available in KDTree mode; the other modes keep their own search every round.
+//
+// With enable_normal_filter(k, maxAngle) match_compatible() looks at the k nearest target points of
+// every vertex within maxDistance, closest first, and takes the first one whose PCA normal is within
+// maxAngle of the vertex normal, so a vertex on one side of a thin structure (ear, nose wing, lips) is
+// not matched to the other side. The vertex normals must point out of the mesh, the target normals
+// are oriented towards the camera (+z).
+class CorrespondenceEngine {
+public:
+    CorrespondenceEngine(CorrespondenceMode mode, const Eigen::MatrixXf& target,
+                         const std::string& gridPath = "", int windowRadius = 2)
+      : mode_(mode), target_(target), windowRadius_(windowRadius) {
+        if (mode_ == CorrespondenceMode::KDTree) {
+            tree_.reset(new TargetKDTree(target_));
+        } else if (mode_ == CorrespondenceMode::BruteForce) {
+            soa_.reset(new SoATargetCloud(target_));
+        } else if (mode_ == CorrespondenceMode::Projective) {
+            grid_.reset(new OrganizedDepthGrid(OrganizedDepthGrid::load(gridPath)));
+            if (grid_->num_valid() != int(target_.cols()))
+                throw std::runtime_error("Organized grid " + gridPath + " has " + std::to_string(grid_->num_valid()) +
+                                         " valid pixels but the target cloud has " + std::to_string(target_.cols()) + " points");
+        }
+    }
+
+    CorrespondenceMode mode() const { return mode_; }
+
+    // Approximation of the KDTree mode (0 = exact, see TargetKDTree::query_batch); the other modes always
+    // search exactly. The warm cache is exact, so match() bypasses it while eps > 0 and every vertex gets
+    // an approximate KD-tree query; the cached lists stay valid for the next exact call.
+    void set_eps(float eps) { eps_ = eps; }
+    float eps() const { return eps_; }
+    // True when match() currently returns approximate correspondences (KDTree mode with eps > 0).
+    bool approximate() const { return mode_ == CorrespondenceMode::KDTree && eps_ > 0.0f; }
+
+    // Recall of a match() result against an exact KD-tree search of the same vertices; also tells how
+    // much Projective mode misses. Builds the KD-tree on first use if the mode has none.
+    double measure_recall(const Eigen::MatrixXf& source, float maxDistance, const NNBatchResult& approx) const {
+        if (!tree_) tree_.reset(new TargetKDTree(target_));
+        return match_recall(approx, tree_->query_batch(source, maxDistance, true));
+    }
+
+    // Instruction set of the BruteForce kernel (Best = the widest the CPU supports)
+    void set_simd_level(SimdLevel level) { simdLevel_ = level; }
+
+    // Returns whether warm start is on: false for slack <= 0 and in every mode but KDTree
+    bool enable_warm_start(float slack) {
+        warmSlack_ = mode_ == CorrespondenceMode::KDTree ? slack : 0.0f;
+        warmCandidates_.clear();
+        warmCentreDistances_.clear();
+        return warm_start_enabled();
+    }
+
+    bool warm_start_enabled() const { return warmSlack_ > 0.0f; }
+
+    // Whether the last match() / match_compatible() call went through the warm cache, and if so how
+    // many vertices were matched from their candidate list
+    bool last_match_warm() const { return lastMatchWarm_; }
+    int warm_hits() const { return warmHits_; }
+
+    // Candidates per vertex and largest angle in degrees between vertex and target normal for
+    // match_compatible(); the target normals are estimated once, from normalNeighbours points each
+    void enable_normal_filter(int candidates, float maxAngleDegrees, int normalNeighbours = 10) {
+        if (candidates < 1) throw std::runtime_error("Normal filter needs at least one candidate per vertex");
+        filterCandidates_ = candidates;
+        filterMinCosine_ = std::cos(maxAngleDegrees * float(EIGEN_PI) / 180.0f);
+        if (!tree_) tree_.reset(new TargetKDTree(target_));
+        if (targetNormals_.empty()) targetNormals_ = estimate_target_normals(*tree_, normalNeighbours);
+    }
+
+    bool normal_filter_enabled() const { return filterCandidates_ > 0; }
+
+    // Closest target point of every column of source within maxDistance whose normal is compatible with
+    // sourceNormals[i]; always an exact KD-tree search. Vertices without a compatible candidate among
+    // their nearest ones are left unmatched.
+    NNBatchResult match_compatible(const Eigen::MatrixXf& source, const std::vector<Eigen::Vector3d>& sourceNormals,
+                                   float maxDistance) const {
+        if (!normal_filter_enabled()) throw std::runtime_error("match_compatible() needs enable_normal_filter()");
+        lastMatchWarm_ = false;
+        const int m = int(source.cols());
+        if (int(sourceNormals.size()) != m)
+            throw std::runtime_error("match_compatible() got " + std::to_string(sourceNormals.size()) +
+                                     " normals for " + std::to_string(m) + " vertices");
+        NNBatchResult result;
+        result.indices.assign(m, -1);
+        result.squaredDistances.assign(m, std::numeric_limits<float>::infinity());
+        result.valid.assign(m, 0);
+
+        const std::vector<int> order = morton_order(source);
+        #pragma omp parallel
+        {
+            std::vector<int> candidates;
+            std::vector<float> squaredDistances;
+            #pragma omp for schedule(dynamic, 256)
+            for (int k = 0; k < m; ++k) {
+                const int i = order[k];
+                const float query[3] = { source(0, i), source(1, i), source(2, i) };
+                tree_->within(query, maxDistance, filterCandidates_, candidates, squaredDistances);
+                const Eigen::Vector3f normal = sourceNormals[i].cast<float>();
+                for (size_t c = 0; c < candidates.size(); ++c) {
+                    if (targetNormals_[candidates[c]].dot(normal) < filterMinCosine_) continue;
+                    result.indices[i] = candidates[c];
+                    result.squaredDistances[i] = squaredDistances[c];
+                    result.valid[i] = 1;
+                    break;
+                }
+            }
+        }
+        return result;
+    }
+
+    // Nearest target point of every column of source within maxDistance
+    NNBatchResult match(const Eigen::MatrixXf& source, float maxDistance) const {
+        lastMatchWarm_ = warmSlack_ > 0.0f && eps_ == 0.0f;
+        if (lastMatchWarm_) return match_warm(source, maxDistance);
+        if (mode_ == CorrespondenceMode::KDTree) return tree_->query_batch(source, maxDistance, true, 256, eps_);
+        if (mode_ == CorrespondenceMode::BruteForce) return match_brute_force(source, maxDistance);
+        if (mode_ == CorrespondenceMode::VoxelHash && (!voxels_ || voxels_->cell_size() < maxDistance))
+            voxels_.reset(new TargetVoxelGrid(target_, maxDistance));
+
+        const int m = int(source.cols());
+        NNBatchResult result;
+        result.indices.assign(m, -1);
+        result.squaredDistances.assign(m, std::numeric_limits<float>::infinity());
+        result.valid.assign(m, 0);
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < m; ++i) {
+            float squaredDistance = std::numeric_limits<float>::infinity();
+            int index = -1;
+            if (mode_ == CorrespondenceMode::Projective) {
+                index = projective_nearest(*grid_, source.col(i), maxDistance, windowRadius_, squaredDistance);
+            } else {
+                const float query[3] = { source(0, i), source(1, i), source(2, i) };
+                index = voxels_->nearest_within(query, maxDistance, squaredDistance);
+            }
+            if (index >= 0) {
+                result.indices[i] = index;
+                result.squaredDistances[i] = squaredDistance;
+                result.valid[i] = 1;
+            }
+        }
+        return result;
+    }
+
+private:
+    NNBatchResult match_brute_force(const Eigen::MatrixXf& source, float maxDistance) const {
+        const int m = int(source.cols());
+        NNBatchResult result;
+        result.indices.assign(m, -1);
+        result.squaredDistances.assign(m, std::numeric_limits<float>::infinity());
+        result.valid.assign(m, 0);
+        soa_->nearest(source, result.indices.data(), result.squaredDistances.data(), maxDistance, simdLevel_);
+        for (int i = 0; i < m; ++i) {
+            result.valid[i] = result.indices[i] >= 0;
+            if (!result.valid[i]) result.squaredDistances[i] = std::numeric_limits<float>::infinity();
+        }
+        return result;
+    }
+
+    NNBatchResult match_warm(const Eigen::MatrixXf& source, float maxDistance) const {
+        const int m = int(source.cols());
+        if (int(warmCandidates_.size()) != m || warmMaxDistance_ != maxDistance) {
+            warmCandidates_.assign(m, std::vector<int>());
+            warmCentreDistances_.assign(m, std::vector<float>());
+            warmCentres_ = Eigen::MatrixXf::Constant(3, m, std::numeric_limits<float>::quiet_NaN());
+            warmMaxDistance_ = maxDistance;
+        }
+
+        NNBatchResult result;
+        result.indices.assign(m, -1);
+        result.squaredDistances.assign(m, std::numeric_limits<float>::infinity());
+        result.valid.assign(m, 0);
+        int hits = 0;
+
+        #pragma omp parallel for schedule(dynamic, 256) reduction(+:hits)
+        for (int i = 0; i < m; ++i) {
+            const float query[3] = { source(0, i), source(1, i), source(2, i) };
+            int index = -1;
+            float squaredDistance = maxDistance * maxDistance;
+            // NaN centres (never searched or not cached) fail the test below
+            const float moved = (source.col(i) - warmCentres_.col(i)).norm();
+            if (moved <= warmSlack_) {
+                // Candidates are sorted by their distance r to the centre and every later one is at
+                // least r - moved away from the vertex, so the scan stops once that exceeds the best
+                const std::vector<int>& candidates = warmCandidates_[i];
+                const std::vector<float>& centreDistances = warmCentreDistances_[i];
+                float reach = maxDistance + moved;
+                for (size_t k = 0; k < candidates.size() && centreDistances[k] <= reach * reach; ++k) {
+                    const int j = candidates[k];
+                    const float ex = target_(0, j) - query[0], ey = target_(1, j) - query[1], ez = target_(2, j) - query[2];
+                    const float d = ex * ex + ey * ey + ez * ez;
+                    if (d <= squaredDistance) {
+                        squaredDistance = d;
+                        index = j;
+                        reach = std::sqrt(d) + moved;
+                    }
+                }
+                ++hits;
+            } else {
+                if (!tree_->nearest_within(query, maxDistance, index, squaredDistance)) index = -1;
+                const float radius = index >= 0 ? std::sqrt(squaredDistance) + 2.0f * warmSlack_ : maxDistance + warmSlack_;
+                bool cached = tree_->within(query, radius, WARM_MAX_CANDIDATES, warmCandidates_[i], warmCentreDistances_[i]);
+                if (index < 0) cached = cached && warmCandidates_[i].empty();
+                warmCentres_.col(i) = cached ? Eigen::Vector3f(source.col(i))
+                                             : Eigen::Vector3f::Constant(std::numeric_limits<float>::quiet_NaN());
+            }
+            if (index >= 0) {
+                result.indices[i] = index;
+                result.squaredDistances[i] = squaredDistance;
+                result.valid[i] = 1;
+            }
+        }
+        warmHits_ = hits;
+        return result;
+    }
+
+    static constexpr int WARM_MAX_CANDIDATES = 256;
+
+    CorrespondenceMode mode_;
+    const Eigen::MatrixXf& target_;
+    int windowRadius_;
+    mutable std::unique_ptr<TargetKDTree> tree_;
+    float eps_ = 0.0f;
+    std::unique_ptr<OrganizedDepthGrid> grid_;
+    std::unique_ptr<SoATargetCloud> soa_;
+    SimdLevel simdLevel_ = SimdLevel::Best;
+    mutable std::unique_ptr<TargetVoxelGrid> voxels_;
+
+    float warmSlack_ = 0.0f;
+    mutable float warmMaxDistance_ = 0.0f;
+    mutable Eigen::MatrixXf warmCentres_;                  // vertex positions of the last full search
+    mutable std::vector<std::vector<int>> warmCandidates_; // target points around each centre, closest first
+    mutable std::vector<std::vector<float>> warmCentreDistances_; // their squared distances to the centre
+    mutable int warmHits_ = 0;
+    mutable bool lastMatchWarm_ = false;
+
+    int filterCandidates_ = 0;          // 0: normal filter off
+    float filterMinCosine_ = -1.0f;
+    std::vector<Eigen::Vector3f> targetNormals_;
+};
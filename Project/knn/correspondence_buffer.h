@@ -0,0 +1,79 @@
+#pragma once
+
+// Compact correspondences of one ICP round. Every entry only names the FLAME vertex and the column
+// of the target cloud it is matched to; residual builders read the target point from the shared
+// cloud by that index, so no per-round copy of the matched points is ever made.
+//
+// compact_matches() fills the buffer from a batch query in one parallel pass: every thread counts
+// the valid matches of its static range of vertices, an exclusive prefix sum over the per-thread
+// counts gives every thread its output offset, and every thread then writes its range. Entries stay
+// in vertex order, and the buffer keeps its capacity from one round to the next.
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "correspondence.h"
+
+struct Correspondence {
+    int flameIndex;  // FLAME vertex
+    int targetIndex; // column of CorrespondenceBuffer::targets
+    float distance;  // distance between the two at matching time
+    float weight;    // multiplies the residual weights of this match
+};
+
+struct CorrespondenceBuffer {
+    const Eigen::MatrixXf* targets = nullptr; // 3 x N cloud the entries point into, not owned
+    std::vector<Correspondence> entries;
+
+    int size() const { return int(entries.size()); }
+    const Correspondence& operator[](int i) const { return entries[i]; }
+
+    // x/y/z of the target point of entry i, contiguous in the column-major cloud
+    const float* target(int i) const { return targets->col(entries[i].targetIndex).data(); }
+
+    double mean_distance() const {
+        double sum = 0.0;
+        for (const Correspondence& c : entries) sum += c.distance;
+        return entries.empty() ? 0.0 : sum / entries.size();
+    }
+
+    bool uniform_weight(float weight) const {
+        return std::all_of(entries.begin(), entries.end(), [&](const Correspondence& c) { return c.weight == weight; });
+    }
+};
+
+// Valid matches of a batch query within maxDistance (query i = FLAME vertex i) into buffer, all
+// with the given weight
+inline void compact_matches(const NNBatchResult& matches, const Eigen::MatrixXf& targets, float maxDistance,
+                            float weight, CorrespondenceBuffer& buffer) {
+    const int m = int(matches.indices.size());
+    const float maxSquaredDistance = maxDistance * maxDistance;
+    auto accepted = [&](int i) { return matches.valid[i] && matches.squaredDistances[i] <= maxSquaredDistance; };
+
+    buffer.targets = &targets;
+    std::vector<int> offsets(omp_get_max_threads() + 1, 0);
+    #pragma omp parallel
+    {
+        const int numThreads = omp_get_num_threads(), thread = omp_get_thread_num();
+        const int begin = int(int64_t(m) * thread / numThreads), end = int(int64_t(m) * (thread + 1) / numThreads);
+        int count = 0;
+        for (int i = begin; i < end; ++i) count += accepted(i);
+        offsets[thread + 1] = count;
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (int t = 0; t < numThreads; ++t) offsets[t + 1] += offsets[t];
+            buffer.entries.resize(offsets[numThreads]);
+        }
+
+        int k = offsets[thread];
+        for (int i = begin; i < end; ++i) {
+            if (!accepted(i)) continue;
+            buffer.entries[k++] = { i, matches.indices[i], std::sqrt(matches.squaredDistances[i]), weight };
+        }
+    }
+}
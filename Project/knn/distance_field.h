@@ -0,0 +1,138 @@
+#pragma once
+
+// Sparse truncated signed distance field of the fixed target cloud.
+// The scan is voxelized once; afterwards the distance to the scan surface and its gradient at any
+// point are a trilinear interpolation over 8 grid nodes, so a residual can sample the field directly
+// at the deformed FLAME vertex and no correspondence search is needed per round.
+//
+// Nodes are stored in blocks of BLOCK^3 nodes that are only allocated within `band` of the scan and
+// looked up through a hash map. Every node holds
+//     sdf = n_q . (c - q),   clamped to [-band, band]
+// where q is the scan point closest to the node centre c and n_q the PCA normal at q, oriented
+// towards viewDirection (see estimate_target_normals). Nodes
+// farther than band from every scan point, e.g. beyond the border of the scan, are unobserved.
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "correspondence.h"
+
+class TargetDistanceField {
+public:
+    static constexpr int BLOCK = 8;
+
+    TargetDistanceField(const Eigen::MatrixXf& target, float resolution, float band,
+                        const Eigen::Vector3f& viewDirection = Eigen::Vector3f::UnitZ(), int normalNeighbours = 10)
+      : resolution_(resolution), band_(band) {
+        TargetKDTree tree(target);
+        const int n = int(target.cols());
+
+        // 1. PCA normals of the scan points
+        const std::vector<Eigen::Vector3f> normals = estimate_target_normals(tree, normalNeighbours, viewDirection);
+
+        // 2. Allocate every block within band of a scan point: the blocks that contain scan points,
+        //    dilated by the band
+        const float blockSize = resolution_ * BLOCK;
+        const int dilation = int(std::ceil(band_ / blockSize));
+        std::unordered_map<int64_t, int> occupied;
+        for (int i = 0; i < n; ++i) {
+            const Eigen::Vector3f p = target.col(i);
+            occupied.emplace(key(int(std::floor(p.x() / blockSize)), int(std::floor(p.y() / blockSize)),
+                                 int(std::floor(p.z() / blockSize))), 0);
+        }
+        for (const auto& entry : occupied) {
+            int bx, by, bz;
+            unkey(entry.first, bx, by, bz);
+            for (int dz = -dilation; dz <= dilation; ++dz)
+                for (int dy = -dilation; dy <= dilation; ++dy)
+                    for (int dx = -dilation; dx <= dilation; ++dx) {
+                        auto inserted = blockIndex_.emplace(key(bx + dx, by + dy, bz + dz), int(blockOrigins_.size()));
+                        if (inserted.second) blockOrigins_.emplace_back(bx + dx, by + dy, bz + dz);
+                    }
+        }
+
+        // 3. Fill the nodes of all blocks in parallel from the closest scan point
+        const int numBlocks = int(blockOrigins_.size());
+        sdf_.assign(size_t(numBlocks) * BLOCK * BLOCK * BLOCK, UNOBSERVED);
+        gradient_.assign(sdf_.size(), Eigen::Vector3f::Zero());
+        #pragma omp parallel for schedule(dynamic, 4)
+        for (int b = 0; b < numBlocks; ++b) {
+            const Eigen::Vector3i origin = blockOrigins_[b] * BLOCK;
+            for (int z = 0; z < BLOCK; ++z)
+                for (int y = 0; y < BLOCK; ++y)
+                    for (int x = 0; x < BLOCK; ++x) {
+                        const Eigen::Vector3f c = (origin + Eigen::Vector3i(x, y, z)).cast<float>() * resolution_;
+                        int q;
+                        float squaredDistance;
+                        if (!tree.nearest_within(c.data(), band_, q, squaredDistance)) continue;
+                        const size_t node = size_t(b) * BLOCK * BLOCK * BLOCK + (z * BLOCK + y) * BLOCK + x;
+                        sdf_[node] = std::max(-band_, std::min(band_, normals[q].dot(c - target.col(q))));
+                        gradient_[node] = normals[q];
+                    }
+        }
+    }
+
+    float band() const { return band_; }
+    float resolution() const { return resolution_; }
+    size_t num_blocks() const { return blockOrigins_.size(); }
+
+    // Trilinear distance and gradient at p. Returns false if p is outside the allocated band or any
+    // of the 8 surrounding nodes is unobserved.
+    bool sample(const Eigen::Vector3d& p, double& distance, Eigen::Vector3d& gradient) const {
+        const Eigen::Vector3d g = p / double(resolution_);
+        const Eigen::Vector3d base = g.array().floor();
+        const Eigen::Vector3d f = g - base;
+        const Eigen::Vector3i i0 = base.cast<int>();
+
+        distance = 0.0;
+        gradient.setZero();
+        for (int corner = 0; corner < 8; ++corner) {
+            const int cx = corner & 1, cy = (corner >> 1) & 1, cz = corner >> 2;
+            const size_t node = find_node(i0.x() + cx, i0.y() + cy, i0.z() + cz);
+            if (node == NONE || sdf_[node] == UNOBSERVED) return false;
+            const double w = (cx ? f.x() : 1.0 - f.x()) * (cy ? f.y() : 1.0 - f.y()) * (cz ? f.z() : 1.0 - f.z());
+            distance += w * sdf_[node];
+            gradient += w * gradient_[node].cast<double>();
+        }
+        return true;
+    }
+
+private:
+    static constexpr float UNOBSERVED = std::numeric_limits<float>::max();
+    static constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+    // 21 bits per block coordinate
+    static int64_t key(int bx, int by, int bz) {
+        const int64_t mask = (int64_t(1) << 21) - 1;
+        return ((int64_t(bx) & mask) << 42) | ((int64_t(by) & mask) << 21) | (int64_t(bz) & mask);
+    }
+    static void unkey(int64_t k, int& bx, int& by, int& bz) {
+        auto signExtend = [](int64_t v) { return int(v >= (int64_t(1) << 20) ? v - (int64_t(1) << 21) : v); };
+        const int64_t mask = (int64_t(1) << 21) - 1;
+        bx = signExtend((k >> 42) & mask);
+        by = signExtend((k >> 21) & mask);
+        bz = signExtend(k & mask);
+    }
+
+    static int floor_div(int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+
+    size_t find_node(int x, int y, int z) const {
+        const int bx = floor_div(x, BLOCK), by = floor_div(y, BLOCK), bz = floor_div(z, BLOCK);
+        const auto it = blockIndex_.find(key(bx, by, bz));
+        if (it == blockIndex_.end()) return NONE;
+        const int lx = x - bx * BLOCK, ly = y - by * BLOCK, lz = z - bz * BLOCK;
+        return size_t(it->second) * BLOCK * BLOCK * BLOCK + (lz * BLOCK + ly) * BLOCK + lx;
+    }
+
+    float resolution_;
+    float band_;
+    std::unordered_map<int64_t, int> blockIndex_;
+    std::vector<Eigen::Vector3i> blockOrigins_;   // block coordinates, in units of BLOCK nodes
+    std::vector<float> sdf_;                      // BLOCK^3 nodes per block, x fastest
+    std::vector<Eigen::Vector3f> gradient_;
+};
@@ -4,11 +4,14 @@
 #include <Eigen/Dense>
 #include <limits>
 #include <omp.h>
-#include "cnpy.h"
+#include "flame_model.h"
+#include "brute_force_kernel.h"
 
 using namespace std;
 using namespace Eigen;
 
+static const SimdLevel BRUTE_FORCE_SIMD = SimdLevel::Best; // 暴力搜索的指令集：Best按CPU自动选AVX-512/AVX2，Scalar为不用SIMD的对照
+
 
 struct KNN_Result{
     Eigen::MatrixXf source;
@@ -17,17 +20,13 @@ struct KNN_Result{
 };
 
 struct Flame_Mesh{
-    const cnpy::NpyArray& v_template_arr;
-    const cnpy::NpyArray& shapedirs_arr;
+    const FlameModel& model;
     const std::vector<double>& betas;
 };
 // Forward declarations
 MatrixXf load_off_as_matrix(const std::string& filename);
 std::vector<int> knn_search_parallel(const MatrixXf& source, const MatrixXf& target);
 VectorXd load_betas(const std::string& filepath, size_t num_betas);
-MatrixXf apply_shape_blendshape(const cnpy::NpyArray& v_template_arr,
-                                 const cnpy::NpyArray& shapedirs_arr,
-                                 const VectorXd& betas);
 void save_matrix_as_txt(const MatrixXf& source, const MatrixXf& nn_points, std::vector<int>& flame_indices);
 KNN_Result knn(bool first_time = true, const std::vector<double>& betas = std::vector<double>(), const MatrixXf& sourceMatrix = MatrixXf());
 
@@ -54,22 +53,10 @@ MatrixXf load_off_as_matrix(const std::string& filename) {
     return mat;
 }
 
-// Parallel KNN search
+// Parallel KNN search on the SIMD brute-force kernel
 std::vector<int> knn_search_parallel(const MatrixXf& source, const MatrixXf& target) {
     std::vector<int> nn_indices(source.cols(), -1);
-    #pragma omp parallel for
-    for (int i = 0; i < source.cols(); ++i) {
-        float min_dist = std::numeric_limits<float>::max();
-        int min_j = -1;
-        for (int j = 0; j < target.cols(); ++j) {
-            float dist = (source.col(i) - target.col(j)).squaredNorm();
-            if (dist < min_dist) {
-                min_dist = dist;
-                min_j = j;
-            }
-        }
-        nn_indices[i] = min_j;
-    }
+    SoATargetCloud(target).nearest(source, nn_indices.data(), nullptr, std::numeric_limits<float>::infinity(), BRUTE_FORCE_SIMD);
     return nn_indices;
 }
 
@@ -85,33 +72,6 @@ VectorXd load_betas(const std::string& filepath, size_t num_betas) {
     return betas;
 }
 
-// Apply shape blendshapes: v_template + shapedirs * betas
-MatrixXf apply_shape_blendshape(const cnpy::NpyArray& v_template_arr,
-    const cnpy::NpyArray& shapedirs_arr,
-    const std::vector<double>& betas) {
-const double* v_data = v_template_arr.data<double>();
-const double* s_data = shapedirs_arr.data<double>();
-
-int N = v_template_arr.shape[0];
-int B = shapedirs_arr.shape[2];
-
-MatrixXf vertices(3, N);
-for (int i = 0; i < N; ++i) {
-Vector3f v(static_cast<float>(v_data[i * 3 + 0]),
-static_cast<float>(v_data[i * 3 + 1]),
-static_cast<float>(v_data[i * 3 + 2]));
-for (int b = 0; b < B; ++b) {
-v.x() += static_cast<float>(s_data[i * 3 * B + 0 * B + b]) * betas[b];
-v.y() += static_cast<float>(s_data[i * 3 * B + 1 * B + b]) * betas[b];
-v.z() += static_cast<float>(s_data[i * 3 * B + 2 * B + b]) * betas[b];
-}
-vertices.col(i) = v;
-}
-
-
-return vertices;
-}
-
 void save_matrix_as_txt(const MatrixXf& source, const MatrixXf& nn_points, std::vector<int>& flame_indices){
 
     //flame.txt : source
@@ -167,15 +127,8 @@ KNN_Result knn(Flame_Mesh& flame_mesh, const MatrixXf& target){
     // Load target point cloud (transformed points)
 
 
-    // Load FLAME shape model
-    cnpy::NpyArray v_template_arr = flame_mesh.v_template_arr;
-    cnpy::NpyArray shapedirs_arr = flame_mesh.shapedirs_arr;
-    std::vector<double> betas = flame_mesh.betas;
-
-
-
     // Generate FLAME mesh with shape deformation
-    MatrixXf source = apply_shape_blendshape(v_template_arr, shapedirs_arr, betas);
+    MatrixXf source = apply_shape_blendshape(flame_mesh.model, flame_mesh.betas);
 
 
     // Run parallel KNN matching
@@ -218,18 +171,15 @@ int main() {
     MatrixXf target = load_off_as_matrix(input_off);
 
     // Load FLAME shape model
-    cnpy::NpyArray v_template_arr = cnpy::npz_load(npz_path, "v_template");
-    cnpy::NpyArray shapedirs_arr = cnpy::npz_load(npz_path, "shapedirs");
+    FlameModel model = FlameModel::load(npz_path);
 
     // Load betas (use zeros if not found)
-    size_t num_betas = shapedirs_arr.shape[2];
+    size_t num_betas = model.numShapeParameters;
 
     std::vector<double> betas = std::vector<double>(num_betas, 0.0);
 
-    Flame_Mesh flame_mesh = {v_template_arr, shapedirs_arr, betas};
+    Flame_Mesh flame_mesh = {model, betas};
 
-    // Generate FLAME mesh with shape deformation
-    // MatrixXf source = apply_shape_blendshape(v_template_arr, shapedirs_arr, betas);
     std::cout << "Running KNN" << std::endl;
     KNN_Result knn_result = knn(flame_mesh, target);
     std::cout << "dimensions of source : " << knn_result.source.cols() << std::endl;
@@ -4,11 +4,14 @@
 #include <Eigen/Dense>
 #include <limits>
 #include <omp.h>
-#include "cnpy.h"
+#include "flame_model.h"
+#include "brute_force_kernel.h"
 
 using namespace std;
 using namespace Eigen;
 
+static const SimdLevel BRUTE_FORCE_SIMD = SimdLevel::Best; // 暴力搜索的指令集：Best按CPU自动选AVX-512/AVX2，Scalar为不用SIMD的对照
+
 
 struct KNN_Result{
     Eigen::MatrixXf source;
@@ -18,8 +21,7 @@ struct KNN_Result{
 
 
 struct Flame_Mesh{
-    const cnpy::NpyArray& v_template_arr;
-    const cnpy::NpyArray& shapedirs_arr;
+    const FlameModel& model;
     const std::vector<double>& betas;
 };
 
@@ -58,33 +60,6 @@ VectorXd load_betas(const std::string& filepath, size_t num_betas) {
 }
 
 
-// Apply shape blendshapes: v_template + shapedirs * betas
-MatrixXf apply_shape_blendshape(const cnpy::NpyArray& v_template_arr,
-                                 const cnpy::NpyArray& shapedirs_arr,
-                                 const std::vector<double>& betas) {
-    const double* v_data = v_template_arr.data<double>();
-    const double* s_data = shapedirs_arr.data<double>();
-
-    int N = v_template_arr.shape[0];
-    int B = shapedirs_arr.shape[2];
-
-    MatrixXf vertices(3, N);
-    for (int i = 0; i < N; ++i) {
-        Vector3f v(static_cast<float>(v_data[i * 3 + 0]),
-                   static_cast<float>(v_data[i * 3 + 1]),
-                   static_cast<float>(v_data[i * 3 + 2]));
-        for (int b = 0; b < B; ++b) {
-            v.x() += static_cast<float>(s_data[i * 3 * B + 0 * B + b]) * betas[b];
-            v.y() += static_cast<float>(s_data[i * 3 * B + 1 * B + b]) * betas[b];
-            v.z() += static_cast<float>(s_data[i * 3 * B + 2 * B + b]) * betas[b];
-        }
-        vertices.col(i) = v;
-    }
-
-
-    return vertices;
-}
-
 void save_matrix_as_txt(const MatrixXf& source, const MatrixXf& nn_points, std::vector<int>& flame_indices){
 
     //flame.txt : source
@@ -130,29 +105,11 @@ void save_matrix_as_txt(const MatrixXf& source, const MatrixXf& nn_points, std::
     }
 }
 
-// Parallel KNN search
+// Parallel KNN search on the SIMD brute-force kernel; matches farther than distance_threshold get -1
 std::vector<int> knn_search_parallel(const MatrixXf& source, const MatrixXf& target) {
     std::vector<int> nn_indices(source.cols(), -1);
     float distance_threshold = 0.02f;
-    #pragma omp parallel for
-    for (int i = 0; i < source.cols(); ++i) {
-        float min_dist = std::numeric_limits<float>::max();
-        int min_j = -1;
-        for (int j = 0; j < target.cols(); ++j) {
-            float dist = (source.col(i) - target.col(j)).squaredNorm();
-            if (dist < min_dist) {
-                min_dist = dist;
-                min_j = j;
-            }
-        }
-        nn_indices[i] = min_j;
-        // Compare the actual distance (sqrt of squared distance) with threshold
-        if (std::sqrt(min_dist) > distance_threshold) {
-            nn_indices[i] = -1;
-        }
-    }
-
-
+    SoATargetCloud(target).nearest(source, nn_indices.data(), nullptr, distance_threshold, BRUTE_FORCE_SIMD);
     return nn_indices;
 }
 
@@ -165,17 +122,8 @@ KNN_Result knn(Flame_Mesh& flame_mesh, const MatrixXf& target){
     //Target is fixed
     //Return : source and nn_points
 
-    // Load FLAME shape model
-    cnpy::NpyArray v_template_arr = flame_mesh.v_template_arr;
-    cnpy::NpyArray shapedirs_arr = flame_mesh.shapedirs_arr;
-    std::vector<double> betas = flame_mesh.betas;
-    MatrixXf source;
-
-    // Add betas to betas_vector
-    source = apply_shape_blendshape(v_template_arr, shapedirs_arr, betas);
-    
-
     // Generate FLAME mesh with shape deformation
+    MatrixXf source = apply_shape_blendshape(flame_mesh.model, flame_mesh.betas);
 
 
     // Run parallel KNN matching
@@ -225,18 +173,15 @@ int main() {
     MatrixXf target = load_off_as_matrix(input_off);
 
     // Load FLAME shape model
-    cnpy::NpyArray v_template_arr = cnpy::npz_load(npz_path, "v_template");
-    cnpy::NpyArray shapedirs_arr = cnpy::npz_load(npz_path, "shapedirs");
+    FlameModel model = FlameModel::load(npz_path);
 
     // Load betas (use zeros if not found)
-    size_t num_betas = shapedirs_arr.shape[2];
+    size_t num_betas = model.numShapeParameters;
 
     std::vector<double> betas = std::vector<double>(num_betas, 0.0);
 
-    Flame_Mesh flame_mesh = {v_template_arr, shapedirs_arr, betas};
+    Flame_Mesh flame_mesh = {model, betas};
 
-    // Generate FLAME mesh with shape deformation
-    // MatrixXf source = apply_shape_blendshape(v_template_arr, shapedirs_arr, betas);
     std::cout << "Running KNN" << std::endl;
     KNN_Result knn_result = knn(flame_mesh, target);
     std::cout << "dimensions of source : " << knn_result.source.cols() << std::endl;
@@ -3,7 +3,8 @@
 #include <vector>
 #include <Eigen/Dense>
 #include <limits>
-#include "nanoflann.hpp"
+#include <sstream>
+#include "correspondence.h"
 
 using namespace std;
 using namespace Eigen;
@@ -64,51 +65,12 @@ void save_matrix(const MatrixXf& mat, const std::string& filename) {
     out << mat << "\n";
 }
 
-struct PointCloudAdaptor {
-    const Eigen::MatrixXf& mat; // 3 x N
-
-    PointCloudAdaptor(const Eigen::MatrixXf& mat_) : mat(mat_) {}
-
-    // Must return the number of data points
-    inline size_t kdtree_get_point_count() const { return mat.cols(); }
-
-    // Returns the dim'th component of the idx'th point
-    inline float kdtree_get_pt(const size_t idx, const size_t dim) const {
-        return mat(dim, idx);
-    }
-
-    // Optional bounding-box computation: return false to default
-    template <class BBOX>
-    bool kdtree_get_bbox(BBOX&) const { return false; }
-};
-
-using namespace nanoflann;
-typedef KDTreeSingleIndexAdaptor<
-    L2_Simple_Adaptor<float, PointCloudAdaptor>,
-    PointCloudAdaptor,
-    3 // dimension
-> KDTree;
-
-// Returns a vector of indices: for each source point, the index of its nearest neighbor in target
+// Returns a vector of indices: for each source point, the index of its nearest neighbor in target.
+// The batch query gives every thread its own result set (sharing one across the OpenMP loop was a
+// data race) and walks the queries in Morton order.
 std::vector<int> knn_search_nanoflann(const Eigen::MatrixXf& source, const Eigen::MatrixXf& target) {
-    PointCloudAdaptor target_pc(target);
-    KDTree index(3, target_pc, KDTreeSingleIndexAdaptorParams(10 /* max leaf */));
-    index.buildIndex();
-
-    std::vector<int> nn_indices(source.cols(), -1);
-
-    nanoflann::KNNResultSet<float> resultSet(1); //look for 1 nearest neighbor
-
-    #pragma omp parallel for
-    for (int i = 0; i < source.cols(); ++i) {
-        size_t ret_index;
-        float out_dist_sqr;
-        float query_pt[3] = { source(0, i), source(1, i), source(2, i) };
-        resultSet.init(&ret_index, &out_dist_sqr);
-        index.findNeighbors(resultSet, query_pt, nanoflann::SearchParameters(10));
-        nn_indices[i] = static_cast<int>(ret_index);
-    }
-    return nn_indices;
+    TargetKDTree index(target);
+    return index.query_batch(source, std::numeric_limits<float>::infinity(), true).indices;
 }
 
 
@@ -0,0 +1,131 @@
+#pragma once
+
+// Projective data association on the organized depth image.
+// rt keeps the H x W pixel grid of the transformed target cloud together with the intrinsics K and
+// the scale/R/T that mapped camera points into the FLAME frame:
+//     p = R * (scale * p_cam) + T
+// A FLAME vertex is mapped back with p_cam = R^T (p - T) / scale, projected through K, and only the
+// pixels of a small window around the projection are candidates. That is a constant amount of work
+// per vertex and needs no spatial index over the target.
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <Eigen/Dense>
+
+struct OrganizedDepthGrid {
+    int width  = 0;
+    int height = 0;
+    Eigen::Matrix3f K = Eigen::Matrix3f::Identity();
+    double scale = 1.0;
+    Eigen::Matrix3d R = Eigen::Matrix3d::Identity();
+    Eigen::Vector3d T = Eigen::Vector3d::Zero();
+    std::vector<Eigen::Vector3f> points; // width * height, row-major, transformed frame; NaN = no depth
+    std::vector<int> pointIndex;         // column of each pixel in the saved point cloud, -1 = no depth
+
+    OrganizedDepthGrid() = default;
+    OrganizedDepthGrid(int w, int h) : width(w), height(h),
+        points(size_t(w) * h, Eigen::Vector3f::Constant(std::numeric_limits<float>::quiet_NaN())),
+        pointIndex(size_t(w) * h, -1) {}
+
+    bool valid(int x, int y) const { return !std::isnan(points[size_t(y) * width + x].x()); }
+
+    // The point cloud keeps the valid pixels in row-major order, which defines pointIndex
+    void index_valid_pixels() {
+        int next = 0;
+        for (size_t i = 0; i < points.size(); ++i)
+            pointIndex[i] = std::isnan(points[i].x()) ? -1 : next++;
+    }
+
+    int num_valid() const {
+        int n = 0;
+        for (int i : pointIndex) n += i >= 0;
+        return n;
+    }
+
+    // Pixel coordinates of a point in the FLAME frame; false if it lies behind the camera
+    bool project(const Eigen::Vector3f& p, float& u, float& v) const {
+        const Eigen::Vector3d pCam = R.transpose() * (p.cast<double>() - T) / scale;
+        if (pCam.z() <= 0.0) return false;
+        u = float(K(0, 0) * pCam.x() / pCam.z() + K(0, 2));
+        v = float(K(1, 1) * pCam.y() / pCam.z() + K(1, 2));
+        return std::isfinite(u) && std::isfinite(v);
+    }
+
+    // Binary file: magic, width, height, K (row-major floats), scale, R (row-major), T, then the
+    // width * height xyz points as floats
+    void save(const std::string& path) const {
+        std::ofstream out(path, std::ios::binary);
+        if (!out.is_open()) throw std::runtime_error("Cannot open output file: " + path);
+        out.write(MAGIC, 8);
+        out.write(reinterpret_cast<const char*>(&width), sizeof(int));
+        out.write(reinterpret_cast<const char*>(&height), sizeof(int));
+        const Eigen::Matrix<float, 3, 3, Eigen::RowMajor> Kr = K;
+        const Eigen::Matrix<double, 3, 3, Eigen::RowMajor> Rr = R;
+        out.write(reinterpret_cast<const char*>(Kr.data()), 9 * sizeof(float));
+        out.write(reinterpret_cast<const char*>(&scale), sizeof(double));
+        out.write(reinterpret_cast<const char*>(Rr.data()), 9 * sizeof(double));
+        out.write(reinterpret_cast<const char*>(T.data()), 3 * sizeof(double));
+        for (const auto& p : points) out.write(reinterpret_cast<const char*>(p.data()), 3 * sizeof(float));
+        if (!out) throw std::runtime_error("Failed to write " + path);
+    }
+
+    static OrganizedDepthGrid load(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open()) throw std::runtime_error("Cannot open file: " + path);
+        char magic[8];
+        int w = 0, h = 0;
+        in.read(magic, 8);
+        if (!in || std::string(magic, 8) != std::string(MAGIC, 8)) throw std::runtime_error("Not an organized depth grid: " + path);
+        in.read(reinterpret_cast<char*>(&w), sizeof(int));
+        in.read(reinterpret_cast<char*>(&h), sizeof(int));
+        if (!in || w <= 0 || h <= 0) throw std::runtime_error("Bad grid size in " + path);
+
+        OrganizedDepthGrid grid(w, h);
+        Eigen::Matrix<float, 3, 3, Eigen::RowMajor> Kr;
+        Eigen::Matrix<double, 3, 3, Eigen::RowMajor> Rr;
+        in.read(reinterpret_cast<char*>(Kr.data()), 9 * sizeof(float));
+        in.read(reinterpret_cast<char*>(&grid.scale), sizeof(double));
+        in.read(reinterpret_cast<char*>(Rr.data()), 9 * sizeof(double));
+        in.read(reinterpret_cast<char*>(grid.T.data()), 3 * sizeof(double));
+        grid.K = Kr;
+        grid.R = Rr;
+        for (auto& p : grid.points) in.read(reinterpret_cast<char*>(p.data()), 3 * sizeof(float));
+        if (!in) throw std::runtime_error("Truncated grid file: " + path);
+        grid.index_valid_pixels();
+        return grid;
+    }
+
+private:
+    static constexpr const char* MAGIC = "ORGGRID1";
+};
+
+// Closest valid pixel point within maxDistance among the (2r+1)^2 pixels around the projection of
+// one query. Returns the pointIndex of the match, -1 if there is none.
+inline int projective_nearest(const OrganizedDepthGrid& grid, const Eigen::Vector3f& query, float maxDistance,
+                              int windowRadius, float& squaredDistance) {
+    float u, v;
+    if (!grid.project(query, u, v)) return -1;
+    const int cx = int(std::lround(u)), cy = int(std::lround(v));
+    if (cx < -windowRadius || cy < -windowRadius || cx >= grid.width + windowRadius || cy >= grid.height + windowRadius) return -1;
+
+    int best = -1;
+    float bestDist = maxDistance * maxDistance;
+    for (int y = std::max(cy - windowRadius, 0); y <= std::min(cy + windowRadius, grid.height - 1); ++y) {
+        for (int x = std::max(cx - windowRadius, 0); x <= std::min(cx + windowRadius, grid.width - 1); ++x) {
+            const size_t pixel = size_t(y) * grid.width + x;
+            if (grid.pointIndex[pixel] < 0) continue;
+            const float d = (grid.points[pixel] - query).squaredNorm();
+            if (d <= bestDist) {
+                bestDist = d;
+                best = grid.pointIndex[pixel];
+            }
+        }
+    }
+    squaredDistance = bestDist;
+    return best;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+// Bounding volume hierarchy over primitives that move but never change topology, such as the
+// triangles or vertices of the deformed FLAME mesh. build() splits the primitives once (median
+// split along the widest centroid axis); after the primitives move, refit() only recomputes the
+// boxes bottom-up, O(n), instead of building a new tree. A refit tree is still exact, its boxes just
+// overlap more as the shape drifts away from the one it was built on.
+//
+// Nodes are stored in depth-first order, children after their parent, so refit() is one reverse
+// sweep over the node array.
+
+#include <vector>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <Eigen/Geometry>
+
+class RefitBVH {
+public:
+    using Box = Eigen::AlignedBox3f;
+
+    explicit RefitBVH(int leafSize = 4) : leafSize_(std::max(leafSize, 1)) {}
+
+    // boxes[i] bounds primitive i
+    void build(const std::vector<Box>& boxes) {
+        const int n = int(boxes.size());
+        primitives_.resize(n);
+        std::iota(primitives_.begin(), primitives_.end(), 0);
+        std::vector<Eigen::Vector3f> centres(n);
+        for (int i = 0; i < n; ++i) centres[i] = boxes[i].center();
+        nodes_.clear();
+        nodes_.reserve(2 * size_t(n / leafSize_ + 1));
+        if (n > 0) build_node(0, n, centres);
+        refit(boxes);
+    }
+
+    // Same primitives, new boxes
+    void refit(const std::vector<Box>& boxes) {
+        for (int k = int(nodes_.size()) - 1; k >= 0; --k) {
+            Node& node = nodes_[k];
+            node.box.setEmpty();
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; ++i) node.box.extend(boxes[primitives_[i]]);
+            } else {
+                node.box.extend(nodes_[k + 1].box);
+                node.box.extend(nodes_[node.first].box);
+            }
+        }
+    }
+
+    bool empty() const { return nodes_.empty(); }
+
+    // Primitive closest to p within sqrt(bestSquaredDistance). distance(i, p) returns the squared
+    // distance from p to primitive i; it is only called for primitives whose leaf box is closer than
+    // the best so far. Returns -1 if nothing is closer than the initial bestSquaredDistance.
+    template <class SquaredDistance>
+    int nearest(const Eigen::Vector3f& p, SquaredDistance&& distance, float& bestSquaredDistance) const {
+        int best = -1;
+        if (nodes_.empty()) return best;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const int k = stack[--top];
+            const Node& node = nodes_[k];
+            if (node.box.squaredExteriorDistance(p) >= bestSquaredDistance) continue;
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; ++i) {
+                    const float d = distance(primitives_[i], p);
+                    if (d < bestSquaredDistance) { bestSquaredDistance = d; best = primitives_[i]; }
+                }
+                continue;
+            }
+            // Visit the nearer child first: push it last
+            const int left = k + 1, right = node.first;
+            const float dl = nodes_[left].box.squaredExteriorDistance(p), dr = nodes_[right].box.squaredExteriorDistance(p);
+            if (dl < dr) { stack[top++] = right; stack[top++] = left; }
+            else         { stack[top++] = left;  stack[top++] = right; }
+        }
+        return best;
+    }
+
+private:
+    struct Node {
+        Box box;
+        int first = 0; // leaf: first entry in primitives_; inner node: index of the right child
+        int count = 0; // leaf: number of primitives; inner node: 0 (the left child is the next node)
+    };
+
+    int build_node(int begin, int end, const std::vector<Eigen::Vector3f>& centres) {
+        const int k = int(nodes_.size());
+        nodes_.emplace_back();
+        if (end - begin <= leafSize_) {
+            nodes_[k].first = begin;
+            nodes_[k].count = end - begin;
+            return k;
+        }
+        Box bounds;
+        bounds.setEmpty();
+        for (int i = begin; i < end; ++i) bounds.extend(centres[primitives_[i]]);
+        int axis;
+        bounds.sizes().maxCoeff(&axis);
+        const int mid = (begin + end) / 2;
+        std::nth_element(primitives_.begin() + begin, primitives_.begin() + mid, primitives_.begin() + end,
+                         [&](int a, int b) { return centres[a][axis] < centres[b][axis]; });
+        build_node(begin, mid, centres);
+        const int right = build_node(mid, end, centres);
+        nodes_[k].first = right;
+        nodes_[k].count = 0;
+        return k;
+    }
+
+    int leafSize_;
+    std::vector<Node> nodes_;
+    std::vector<int> primitives_; // primitive ids, grouped by leaf
+};
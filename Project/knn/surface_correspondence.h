@@ -0,0 +1,132 @@
+#pragma once
+
+// Reverse correspondences: every scan point is matched to its closest point on the deformed FLAME
+// surface, given as a triangle and barycentric coordinates. The surface point
+//     s(β) = Σ_k b_k (t_{v_k} + S_{v_k} β)
+// is linear in the betas like a vertex, so it gets the same point-to-point and point-to-plane
+// residuals, but it is not restricted to the vertex positions.
+//
+// The triangles live in a RefitBVH that is built on the first update() and only refit afterwards:
+// betas never change the topology of the mesh.
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "refit_bvh.h"
+
+// Closest scan-to-surface match of one scan point
+struct SurfaceMatch {
+    int face = -1;                                         // -1 if the surface is farther than the radius
+    Eigen::Vector3f barycentric = Eigen::Vector3f::Zero(); // weights of faces[face][0..2]
+    float squaredDistance = std::numeric_limits<float>::infinity();
+};
+
+// Closest point to p on triangle abc, with its barycentric coordinates (Ericson, Real-Time
+// Collision Detection, 5.1.5)
+inline Eigen::Vector3f closest_point_on_triangle(const Eigen::Vector3f& p, const Eigen::Vector3f& a,
+                                                 const Eigen::Vector3f& b, const Eigen::Vector3f& c,
+                                                 Eigen::Vector3f& barycentric) {
+    const Eigen::Vector3f ab = b - a, ac = c - a, ap = p - a;
+    const float d1 = ab.dot(ap), d2 = ac.dot(ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) { barycentric << 1, 0, 0; return a; }
+
+    const Eigen::Vector3f bp = p - b;
+    const float d3 = ab.dot(bp), d4 = ac.dot(bp);
+    if (d3 >= 0.0f && d4 <= d3) { barycentric << 0, 1, 0; return b; }
+
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        const float v = d1 / (d1 - d3);
+        barycentric << 1 - v, v, 0;
+        return a + v * ab;
+    }
+
+    const Eigen::Vector3f cp = p - c;
+    const float d5 = ab.dot(cp), d6 = ac.dot(cp);
+    if (d6 >= 0.0f && d5 <= d6) { barycentric << 0, 0, 1; return c; }
+
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        const float w = d2 / (d2 - d6);
+        barycentric << 1 - w, 0, w;
+        return a + w * ac;
+    }
+
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+        const float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        barycentric << 0, 1 - w, w;
+        return b + w * (c - b);
+    }
+
+    const float denom = 1.0f / (va + vb + vc);
+    const float v = vb * denom, w = vc * denom;
+    barycentric << 1 - v - w, v, w;
+    return a + v * ab + w * ac;
+}
+
+class FlameSurfaceBVH {
+public:
+    explicit FlameSurfaceBVH(const std::vector<Eigen::Vector3i>& faces) : faces_(faces), boxes_(faces.size()) {}
+
+    // New vertex positions (3V, x/y/z per vertex): the first call builds the tree, later calls refit it
+    void update(const Eigen::VectorXd& vertices) {
+        const int numVertices = int(vertices.size() / 3);
+        vertices_.resize(numVertices);
+        for (int v = 0; v < numVertices; ++v) vertices_[v] = vertices.segment<3>(3 * v).cast<float>();
+
+        #pragma omp parallel for schedule(static)
+        for (int f = 0; f < int(faces_.size()); ++f) {
+            RefitBVH::Box box(vertices_[faces_[f][0]]);
+            box.extend(vertices_[faces_[f][1]]);
+            box.extend(vertices_[faces_[f][2]]);
+            boxes_[f] = box;
+        }
+        if (bvh_.empty()) bvh_.build(boxes_);
+        else              bvh_.refit(boxes_);
+    }
+
+    // Closest surface point of every column of points within maxDistance
+    std::vector<SurfaceMatch> closest_points(const Eigen::MatrixXf& points, float maxDistance) const {
+        const int n = int(points.cols());
+        std::vector<SurfaceMatch> matches(n);
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < n; ++i) {
+            const Eigen::Vector3f p = points.col(i);
+            float best = maxDistance * maxDistance;
+            Eigen::Vector3f barycentric, bestBarycentric;
+            // nearest() accepts d under the same test right after this call returns
+            const int face = bvh_.nearest(p, [&](int f, const Eigen::Vector3f& q) {
+                const Eigen::Vector3f s = closest_point_on_triangle(
+                    q, vertices_[faces_[f][0]], vertices_[faces_[f][1]], vertices_[faces_[f][2]], barycentric);
+                const float d = (s - q).squaredNorm();
+                if (d < best) bestBarycentric = barycentric;
+                return d;
+            }, best);
+            if (face >= 0) {
+                matches[i].face = face;
+                matches[i].barycentric = bestBarycentric;
+                matches[i].squaredDistance = best;
+            }
+        }
+        return matches;
+    }
+
+    // Unit normal of face f at the current vertex positions
+    Eigen::Vector3f face_normal(int f) const {
+        const Eigen::Vector3f& a = vertices_[faces_[f][0]];
+        return (vertices_[faces_[f][1]] - a).cross(vertices_[faces_[f][2]] - a).normalized();
+    }
+
+    const std::vector<Eigen::Vector3i>& faces() const { return faces_; }
+
+private:
+    std::vector<Eigen::Vector3i> faces_;
+    std::vector<Eigen::Vector3f> vertices_;
+    std::vector<RefitBVH::Box> boxes_;
+    RefitBVH bvh_;
+};
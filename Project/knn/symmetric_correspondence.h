@@ -0,0 +1,88 @@
+#pragma once
+
+// Reverse half of the symmetric correspondences: every scan point is matched to its nearest FLAME
+// vertex, so scan regions that no vertex is matched to still pull on the fit.
+//
+// The FLAME vertices move every round but their number never changes, so they live in a RefitBVH
+// (leaves of a few points) that is built on the first update() and only refit afterwards.
+// A residual of a scan point q matched to vertex v has the same form as a forward match of v to q.
+// All scan points of one vertex are therefore folded into one match against their mean,
+//     Σ_q ||p_v - q||² = c_v ||p_v - mean_q||² + const,
+// with the weight scaled by sqrt(c_v), which keeps the number of residuals at most V.
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "refit_bvh.h"
+
+class FlameVertexBVH {
+public:
+    explicit FlameVertexBVH(int leafSize = 8) : bvh_(leafSize) {}
+
+    // New vertex positions (3V, x/y/z per vertex): the first call builds the tree, later calls refit it
+    void update(const Eigen::VectorXd& vertices) {
+        const int numVertices = int(vertices.size() / 3);
+        vertices_.resize(numVertices);
+        boxes_.resize(numVertices);
+        #pragma omp parallel for schedule(static)
+        for (int v = 0; v < numVertices; ++v) {
+            vertices_[v] = vertices.segment<3>(3 * v).cast<float>();
+            boxes_[v] = RefitBVH::Box(vertices_[v]);
+        }
+        if (bvh_.empty()) bvh_.build(boxes_);
+        else              bvh_.refit(boxes_);
+    }
+
+    // Nearest vertex of every column of points within maxDistance, -1 if there is none
+    std::vector<int> nearest_vertices(const Eigen::MatrixXf& points, float maxDistance) const {
+        const int n = int(points.cols());
+        std::vector<int> nearest(n, -1);
+        #pragma omp parallel for schedule(dynamic, 256)
+        for (int i = 0; i < n; ++i) {
+            float best = maxDistance * maxDistance;
+            nearest[i] = bvh_.nearest(points.col(i), [&](int v, const Eigen::Vector3f& q) {
+                return (vertices_[v] - q).squaredNorm();
+            }, best);
+        }
+        return nearest;
+    }
+
+private:
+    std::vector<Eigen::Vector3f> vertices_;
+    std::vector<RefitBVH::Box> boxes_;
+    RefitBVH bvh_;
+};
+
+// Reverse matches folded per vertex: vertices[i] is pulled towards meanTargets.col(i) by counts[i]
+// scan points
+struct ReverseMatches {
+    std::vector<int> vertices;
+    Eigen::MatrixXf meanTargets;
+    std::vector<int> counts;
+};
+
+inline ReverseMatches group_reverse_matches(const std::vector<int>& nearestVertex, const Eigen::MatrixXf& points,
+                                            int numVertices) {
+    std::vector<int> counts(numVertices, 0);
+    Eigen::MatrixXd sums = Eigen::MatrixXd::Zero(3, numVertices);
+    for (int i = 0; i < int(nearestVertex.size()); ++i) {
+        const int v = nearestVertex[i];
+        if (v < 0) continue;
+        ++counts[v];
+        sums.col(v) += points.col(i).cast<double>();
+    }
+
+    ReverseMatches matches;
+    for (int v = 0; v < numVertices; ++v)
+        if (counts[v] > 0) matches.vertices.push_back(v);
+    matches.meanTargets.resize(3, matches.vertices.size());
+    matches.counts.resize(matches.vertices.size());
+    for (int i = 0; i < int(matches.vertices.size()); ++i) {
+        const int v = matches.vertices[i];
+        matches.counts[i] = counts[v];
+        matches.meanTargets.col(i) = (sums.col(v) / counts[v]).cast<float>();
+    }
+    return matches;
+}
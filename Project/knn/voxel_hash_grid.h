@@ -0,0 +1,139 @@
+#pragma once
+
+// Uniform spatial-hash grid over the fixed target cloud for fixed-radius nearest-neighbour queries.
+// knn() discards every match farther than max_distance, so with the cell size set to max_distance
+// the nearest valid point of a query can only lie in the 3 x 3 x 3 cells around the query's cell.
+// A query is therefore at most 27 hash probes plus a scan over the few points in those cells.
+//
+// The points are sorted by cell and stored cell after cell as x/y/z arrays, so the scan of one
+// cell is a contiguous, vectorizable loop. The hash table is open addressing with linear probing.
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include <Eigen/Dense>
+
+class TargetVoxelGrid {
+public:
+    TargetVoxelGrid(const Eigen::MatrixXf& target, float cellSize) : cellSize_(cellSize), invCellSize_(1.0f / cellSize) {
+        if (!(cellSize > 0.0f)) throw std::runtime_error("TargetVoxelGrid: cell size must be positive");
+        const int n = int(target.cols());
+
+        // Sort the points by cell key
+        std::vector<uint64_t> keys(n);
+        for (int i = 0; i < n; ++i) keys[i] = cell_key(target(0, i), target(1, i), target(2, i));
+        std::vector<int> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+
+        xs_.resize(n); ys_.resize(n); zs_.resize(n); indices_.resize(n);
+        for (int k = 0; k < n; ++k) {
+            const int i = order[k];
+            xs_[k] = target(0, i); ys_[k] = target(1, i); zs_[k] = target(2, i);
+            indices_[k] = i;
+        }
+
+        // One hash slot per non-empty cell, table at most half full
+        size_t numCells = 0;
+        for (int k = 0; k < n; ++k) numCells += (k == 0 || keys[order[k]] != keys[order[k - 1]]);
+        size_t capacity = 16;
+        while (capacity < 2 * numCells) capacity <<= 1;
+        slots_.assign(capacity, Slot());
+        mask_ = capacity - 1;
+
+        for (int k = 0; k < n;) {
+            const uint64_t key = keys[order[k]];
+            int end = k;
+            while (end < n && keys[order[end]] == key) ++end;
+            size_t s = hash(key) & mask_;
+            while (slots_[s].count != 0) s = (s + 1) & mask_;
+            slots_[s] = Slot{key, k, end - k};
+            k = end;
+        }
+        numCells_ = numCells;
+    }
+
+    float cell_size() const { return cellSize_; }
+    size_t num_cells() const { return numCells_; }
+
+    // Nearest target point within maxDistance (<= cell size) of one query; -1 if there is none.
+    // The query's own cell is scanned first; a neighbour cell is skipped if its box is already
+    // farther away than the best match so far.
+    int nearest_within(const float* query, float maxDistance, float& squaredDistance) const {
+        const int c[3] = { cell_coord(query[0]), cell_coord(query[1]), cell_coord(query[2]) };
+        // Squared gap between the query and the lower / own / upper neighbour cell along each axis
+        float gap[3][3];
+        for (int a = 0; a < 3; ++a) {
+            const float lower = query[a] - c[a] * cellSize_;
+            gap[a][0] = lower * lower;
+            gap[a][1] = 0.0f;
+            gap[a][2] = (cellSize_ - lower) * (cellSize_ - lower);
+        }
+
+        float best = maxDistance * maxDistance;
+        int bestIndex = -1;
+        scan_cell(c[0], c[1], c[2], query, best, bestIndex);
+        for (int dz = -1; dz <= 1; ++dz)
+            for (int dy = -1; dy <= 1; ++dy)
+                for (int dx = -1; dx <= 1; ++dx) {
+                    if ((dx | dy | dz) == 0) continue;
+                    if (gap[0][dx + 1] + gap[1][dy + 1] + gap[2][dz + 1] > best) continue;
+                    scan_cell(c[0] + dx, c[1] + dy, c[2] + dz, query, best, bestIndex);
+                }
+        squaredDistance = best;
+        return bestIndex < 0 ? -1 : indices_[bestIndex];
+    }
+
+private:
+    struct Slot {
+        uint64_t key = 0;
+        int start = 0;
+        int count = 0; // 0 marks an empty slot
+    };
+
+    int cell_coord(float v) const { return int(std::floor(v * invCellSize_)); }
+
+    // 21 bits per cell coordinate
+    static uint64_t pack(int x, int y, int z) {
+        const uint64_t mask = (uint64_t(1) << 21) - 1;
+        return ((uint64_t(x) & mask) << 42) | ((uint64_t(y) & mask) << 21) | (uint64_t(z) & mask);
+    }
+    uint64_t cell_key(float x, float y, float z) const { return pack(cell_coord(x), cell_coord(y), cell_coord(z)); }
+
+    static uint64_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    void scan_cell(int x, int y, int z, const float* query, float& best, int& bestIndex) const {
+        const Slot* cell = find(pack(x, y, z));
+        if (cell == nullptr) return;
+        const int end = cell->start + cell->count;
+        for (int k = cell->start; k < end; ++k) {
+            const float ex = xs_[k] - query[0], ey = ys_[k] - query[1], ez = zs_[k] - query[2];
+            const float d = ex * ex + ey * ey + ez * ez;
+            if (d <= best) { best = d; bestIndex = k; }
+        }
+    }
+
+    const Slot* find(uint64_t key) const {
+        for (size_t s = hash(key) & mask_;; s = (s + 1) & mask_) {
+            if (slots_[s].count == 0) return nullptr;
+            if (slots_[s].key == key) return &slots_[s];
+        }
+    }
+
+    float cellSize_;
+    float invCellSize_;
+    size_t numCells_ = 0;
+    size_t mask_ = 0;
+    std::vector<Slot> slots_;
+    std::vector<float> xs_, ys_, zs_; // points sorted by cell
+    std::vector<int> indices_;        // original column of each sorted point
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+// 由粗到细激活 betas
+// FLAME 的形状基按方差从大到小排列，前几十个分量已经解释了大部分几何。分阶段优化时第 k 轮只解前
+// stages[k] 个 betas，其余固定在 0；每个阶段从上一阶段的解开始，最后一个阶段之后一直用它。
+// 激活的个数只增不减，所以没激活的 betas 永远是 0，只解前 K 个就是完整问题限制在前 K 维上的解，
+// 这个小问题条件也更好。
+//   ceres：用 SubsetManifold 把后 B - K 个固定住
+//   法方程：只组装、只解 JᵀJ 左上角的 K x K 块
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <ceres/ceres.h>
+
+// 第 stage 轮（从 0 开始）激活的 betas 个数，不超过 numShapeParameters
+inline int stage_active_betas(const int* stages, int numStages, int stage, int numShapeParameters) {
+    if (numStages <= 0) return numShapeParameters;
+    const int k = std::min(stage, numStages - 1);
+    return std::max(1, std::min(stages[k], numShapeParameters));
+}
+
+// 只让 betas 的前 numActive 个参与优化，numActive >= numShapeParameters 时什么都不做（betas 还没有 manifold）
+// 每次调用都给 problem 一个新的 SubsetManifold，problem 拥有它直到析构；跨轮复用的问题用
+// PersistentShapeProblem::set_active_betas，个数不变时不重设
+inline void restrict_to_leading_betas(ceres::Problem& problem, double* betas, int numShapeParameters, int numActive) {
+    if (numActive >= numShapeParameters) return;
+    std::vector<int> constant(numShapeParameters - numActive);
+    std::iota(constant.begin(), constant.end(), numActive);
+    problem.SetManifold(betas, new ceres::SubsetManifold(numShapeParameters, constant));
+}
@@ -0,0 +1,64 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <omp.h>
+#include "flame_model.h"
+
+// Convert FLAME npz models into memory-mappable .flamecache files (see flame_cache.h).
+// The cache is written next to the npz (<stem>.flamecache); FlameModel::load() then maps it instead
+// of decompressing the npz, as long as the cache is not older than the npz.
+// Re-run this tool whenever an npz, mask or landmark embedding changes.
+
+// Store shapedirs as float: halves the file and page-cache footprint, but the loader then has to
+// widen it to double, so the shape model is no longer zero-copy.
+static const bool USE_FLOAT_SHAPEDIRS = false;
+
+struct CacheJob {
+    std::string npz_path;
+    std::string mask_path;       // optional, array "face"
+    std::string landmark_path;   // optional, arrays "lmk_face_idx" and "lmk_b_coords"
+};
+
+static bool file_exists(const std::string& path) {
+    return !path.empty() && std::ifstream(path).good();
+}
+
+int main() {
+    std::vector<CacheJob> jobs = {
+        {"../model/FLAME2023/flame2023_no_jaw.npz", "../model/FLAME2023/face_mask.npz",
+         "../model/mediapipe_landmark_embedding/mediapipe_landmark_embedding.npz"},
+        {"../model/FLAME2023/face_only_mesh.npz", "", ""},
+    };
+
+    for (const auto& job : jobs) {
+        if (!file_exists(job.npz_path)) {
+            std::cerr << "Skipping " << job.npz_path << ": not found" << std::endl;
+            continue;
+        }
+        const double t0 = omp_get_wtime();
+
+        FlameModel model = FlameModel::load_npz(job.npz_path, file_exists(job.mask_path) ? job.mask_path : "");
+
+        if (file_exists(job.landmark_path)) {
+            std::vector<size_t> baryShape;
+            model.landmarkFaces = read_npz_array<int>(job.landmark_path, "lmk_face_idx");
+            std::vector<double> bary = read_npz_array<double>(job.landmark_path, "lmk_b_coords", &baryShape);
+            if (baryShape.size() != 2 || baryShape[1] != 3 || baryShape[0] != model.landmarkFaces.size()) {
+                std::cerr << "Unexpected landmark embedding shape in " << job.landmark_path << std::endl;
+                return 1;
+            }
+            for (size_t l = 0; l < model.landmarkFaces.size(); ++l)
+                model.landmarkBarycentrics.emplace_back(bary[3 * l], bary[3 * l + 1], bary[3 * l + 2]);
+        }
+
+        const std::string cache_path = flame_cache_path(job.npz_path);
+        write_flame_cache(cache_path, model.cache_arrays(), USE_FLOAT_SHAPEDIRS);
+
+        std::cout << "Wrote " << cache_path << " (" << model.numVertices << " vertices, "
+                  << model.numShapeParameters << " betas, " << model.faces.size() << " faces, "
+                  << model.faceMask.size() << " mask, " << model.landmarkFaces.size() << " landmarks) in "
+                  << omp_get_wtime() - t0 << " s" << std::endl;
+    }
+    return 0;
+}
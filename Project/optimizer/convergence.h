@@ -0,0 +1,99 @@
+#pragma once
+
+// ICP 外层循环的收敛判断
+// 每轮记下 betas 的相对变化 ||Δβ|| / ||β||、对应点的平均距离和匹配数（内点数）。一轮算"没有改进"：
+//   betas 的相对变化小于 betaTolerance（下一轮 knn 会找到同样的点，再解也是同一个解），或者
+//   平均距离的相对下降小于 distanceTolerance，并且匹配数的相对增加小于 inlierTolerance。
+// 连续 patience 轮没有改进就停，但至少跑 minRounds 轮，最多 maxRounds 轮。
+// 没有对应点的模式（距离场）不记距离和匹配数，只看 betas。
+// 由粗到细模式下还没激活全部 betas 的轮次不算停滞（下一阶段会放开新的 betas），不会在粗阶段提前停。
+// 前几轮离收敛还远，ceres 不需要每轮都解到底：第 k 轮的 LM 最多迭代 firstInnerIterations * 2^(k-1) 次，
+// 不超过 maxInnerIterations。
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+struct ConvergenceSettings {
+    double betaTolerance       = 1e-3;
+    double distanceTolerance   = 1e-3;
+    double inlierTolerance     = 1e-3;
+    int    patience            = 1;
+    int    minRounds           = 2;
+    int    maxRounds           = 10;
+    int    firstInnerIterations = 5;
+    int    maxInnerIterations   = 50;
+};
+
+class IcpConvergence {
+public:
+    explicit IcpConvergence(const ConvergenceSettings& settings) : settings_(settings) {}
+
+    // 这一轮 knn 之后：对应点的平均距离和匹配数
+    void record_matches(double meanDistance, int inliers) {
+        meanDistance_ = meanDistance;
+        inliers_ = inliers;
+        hasMatches_ = true;
+    }
+
+    // 这一轮求解之后：解之前和解之后的 betas，判断这一轮有没有改进。
+    // finalStage 为 false 表示这一轮还不是最终的问题（只解了部分 betas，或者对应点是近似搜索的），这种轮不算停滞，
+    // 距离和匹配数也不留作比较的基准：第一轮最终的问题只记基准，之后才和它比
+    void record_update(const std::vector<double>& before, const std::vector<double>& after, bool finalStage = true) {
+        ++round_;
+        double change = 0.0, norm = 0.0;
+        for (size_t i = 0; i < after.size(); ++i) {
+            change += (after[i] - before[i]) * (after[i] - before[i]);
+            norm += after[i] * after[i];
+        }
+        const double betaChange = std::sqrt(change) / std::max(std::sqrt(norm), 1e-12);
+        bool stalled = finalStage && betaChange < settings_.betaTolerance;
+
+        std::cout << "Round " << round_ << ": relative beta change " << betaChange;
+        if (hasMatches_) {
+            std::cout << ", mean distance " << meanDistance_ << ", " << inliers_ << " matches";
+            if (hasPrevious_) {
+                const double distanceGain = (previousMeanDistance_ - meanDistance_) / std::max(previousMeanDistance_, 1e-12);
+                const double inlierGain = double(inliers_ - previousInliers_) / std::max(previousInliers_, 1);
+                stalled = stalled || (finalStage && distanceGain < settings_.distanceTolerance && inlierGain < settings_.inlierTolerance);
+            }
+            previousMeanDistance_ = meanDistance_;
+            previousInliers_ = inliers_;
+            hasPrevious_ = finalStage;
+        }
+        std::cout << std::endl;
+        hasMatches_ = false;
+        stalledRounds_ = stalled ? stalledRounds_ + 1 : 0;
+    }
+
+    // 外层循环是否该停（reason 里写原因）
+    bool converged(std::string* reason = nullptr) const {
+        if (round_ >= settings_.maxRounds) {
+            if (reason) *reason = "reached " + std::to_string(settings_.maxRounds) + " rounds";
+            return true;
+        }
+        if (round_ >= settings_.minRounds && stalledRounds_ >= settings_.patience) {
+            if (reason) *reason = "no improvement in " + std::to_string(stalledRounds_) + " round(s)";
+            return true;
+        }
+        return false;
+    }
+
+    // 下一轮 ceres 最多迭代的次数
+    int max_inner_iterations() const {
+        const int shift = std::min(round_, 20);
+        return std::min(settings_.maxInnerIterations, settings_.firstInnerIterations << shift);
+    }
+
+    int rounds() const { return round_; }
+
+private:
+    ConvergenceSettings settings_;
+    int round_ = 0;
+    int stalledRounds_ = 0;
+    bool hasMatches_ = false, hasPrevious_ = false;
+    double meanDistance_ = 0.0, previousMeanDistance_ = 0.0;
+    int inliers_ = 0, previousInliers_ = 0;
+};
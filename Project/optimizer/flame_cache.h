@@ -0,0 +1,248 @@
+#pragma once
+
+// Precompiled FLAME model cache (.flamecache), written by build_flame_cache and mapped by
+// FlameModel::load(). Decompressing shapedirs from the npz dominates the start-up of the short
+// per-frame tools; the cache stores every array already in the solver's layout, so loading is an
+// mmap of the file and the shape model is read straight from the (shared) page cache.
+//
+// Layout: a 128 byte FlameCacheHeader, then one section per array, each starting at a 64 byte
+// aligned offset:
+//   template   3V doubles (x0 y0 z0 x1 ...)
+//   shapedirs  3V x B row-major, double or float (shapeDirWordSize)
+//   faces      F x 3 int32
+//   mask       numMask int32 vertex indices (optional)
+//   landmarks  L int32 face indices + L x 3 double barycentric coordinates (optional)
+// All values are little-endian. Bump FLAME_CACHE_VERSION whenever the layout changes; older files
+// are then rejected and have to be rebuilt.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+constexpr char     FLAME_CACHE_MAGIC[8]   = {'F', 'L', 'A', 'M', 'E', 'C', 'A', 'C'};
+constexpr uint32_t FLAME_CACHE_VERSION    = 1;
+constexpr uint64_t FLAME_CACHE_ALIGNMENT  = 64;
+
+struct FlameCacheHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t numVertices;
+    uint32_t numShapeParameters;
+    uint32_t numFaces;
+    uint32_t numMask;
+    uint32_t numLandmarks;
+    uint32_t shapeDirWordSize;    // 8 = double, 4 = float
+    uint64_t fileSize;
+    uint64_t templateOffset;
+    uint64_t shapeDirOffset;
+    uint64_t facesOffset;
+    uint64_t maskOffset;
+    uint64_t landmarkFacesOffset;
+    uint64_t landmarkBaryOffset;
+    uint64_t reserved[4];
+};
+static_assert(sizeof(FlameCacheHeader) == 128, "FlameCacheHeader layout changed, bump FLAME_CACHE_VERSION");
+
+// Pointers to the arrays of one model, either to be written or as mapped from a cache file.
+// Exactly one of shapeDirections / shapeDirectionsFloat is set.
+struct FlameCacheArrays {
+    int numVertices        = 0;
+    int numShapeParameters = 0;
+    int numFaces           = 0;
+    int numMask            = 0;
+    int numLandmarks       = 0;
+    const double*  templateVertices      = nullptr;
+    const double*  shapeDirections       = nullptr;
+    const float*   shapeDirectionsFloat  = nullptr;
+    const int32_t* faces                 = nullptr;
+    const int32_t* mask                  = nullptr;
+    const int32_t* landmarkFaces         = nullptr;
+    const double*  landmarkBarycentrics  = nullptr;
+};
+
+inline uint64_t align_cache_offset(uint64_t offset) {
+    return (offset + FLAME_CACHE_ALIGNMENT - 1) / FLAME_CACHE_ALIGNMENT * FLAME_CACHE_ALIGNMENT;
+}
+
+// <stem>.flamecache next to <stem>.npz
+inline std::string flame_cache_path(const std::string& npzPath) {
+    const size_t dot = npzPath.find_last_of('.');
+    const size_t slash = npzPath.find_last_of('/');
+    const bool hasExtension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+    return (hasExtension ? npzPath.substr(0, dot) : npzPath) + ".flamecache";
+}
+
+inline bool is_flame_cache(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[8];
+    return in.read(magic, 8) && std::memcmp(magic, FLAME_CACHE_MAGIC, 8) == 0;
+}
+
+// Header check without mapping the file: magic, current version and header size, and a file size
+// that matches the one recorded by write_flame_cache (catches truncated and old-format caches)
+inline bool flame_cache_header_is_valid(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    const uint64_t size = uint64_t(in.tellg());
+    FlameCacheHeader h;
+    if (size < sizeof(h) || !in.seekg(0).read(reinterpret_cast<char*>(&h), sizeof(h))) return false;
+    return std::memcmp(h.magic, FLAME_CACHE_MAGIC, 8) == 0 && h.version == FLAME_CACHE_VERSION &&
+           h.headerSize == sizeof(FlameCacheHeader) && h.fileSize == size;
+}
+
+// A cache is only used in place of its npz if its header is valid and, when the npz exists, it is at
+// least as new as the npz
+inline bool flame_cache_is_fresh(const std::string& cachePath, const std::string& npzPath) {
+    struct stat cacheStat, npzStat;
+    if (stat(cachePath.c_str(), &cacheStat) != 0 || !flame_cache_header_is_valid(cachePath)) return false;
+    if (stat(npzPath.c_str(), &npzStat) != 0) return true;
+    return cacheStat.st_mtime >= npzStat.st_mtime;
+}
+
+inline void write_flame_cache(const std::string& path, const FlameCacheArrays& a, bool floatShapeDirs) {
+    if (a.templateVertices == nullptr || a.shapeDirections == nullptr)
+        throw std::runtime_error("write_flame_cache: template and shapedirs are required");
+
+    const uint64_t rows = uint64_t(a.numVertices) * 3;
+    const uint64_t shapeCount = rows * uint64_t(a.numShapeParameters);
+
+    FlameCacheHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, FLAME_CACHE_MAGIC, 8);
+    h.version            = FLAME_CACHE_VERSION;
+    h.headerSize         = sizeof(FlameCacheHeader);
+    h.numVertices        = uint32_t(a.numVertices);
+    h.numShapeParameters = uint32_t(a.numShapeParameters);
+    h.numFaces           = uint32_t(a.numFaces);
+    h.numMask            = uint32_t(a.numMask);
+    h.numLandmarks       = uint32_t(a.numLandmarks);
+    h.shapeDirWordSize   = floatShapeDirs ? 4 : 8;
+
+    uint64_t offset = align_cache_offset(sizeof(FlameCacheHeader));
+    h.templateOffset      = offset; offset = align_cache_offset(offset + rows * sizeof(double));
+    h.shapeDirOffset      = offset; offset = align_cache_offset(offset + shapeCount * h.shapeDirWordSize);
+    h.facesOffset         = offset; offset = align_cache_offset(offset + uint64_t(a.numFaces) * 3 * sizeof(int32_t));
+    h.maskOffset          = offset; offset = align_cache_offset(offset + uint64_t(a.numMask) * sizeof(int32_t));
+    h.landmarkFacesOffset = offset; offset = align_cache_offset(offset + uint64_t(a.numLandmarks) * sizeof(int32_t));
+    h.landmarkBaryOffset  = offset; offset = offset + uint64_t(a.numLandmarks) * 3 * sizeof(double);
+    h.fileSize            = offset;
+
+    // Write to a temporary file and rename, so a concurrently starting tool never maps a half-written cache
+    const std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("write_flame_cache: cannot open " + tmpPath);
+
+        auto writeAt = [&](uint64_t at, const void* data, uint64_t bytes) {
+            static const char zeros[FLAME_CACHE_ALIGNMENT] = {};
+            const uint64_t pos = uint64_t(out.tellp());
+            out.write(zeros, std::streamsize(at - pos)); // padding up to the aligned section start
+            if (bytes > 0) out.write(static_cast<const char*>(data), std::streamsize(bytes));
+        };
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        writeAt(h.templateOffset, a.templateVertices, rows * sizeof(double));
+        if (floatShapeDirs) {
+            std::vector<float> narrowed(a.shapeDirections, a.shapeDirections + shapeCount);
+            writeAt(h.shapeDirOffset, narrowed.data(), shapeCount * sizeof(float));
+        } else {
+            writeAt(h.shapeDirOffset, a.shapeDirections, shapeCount * sizeof(double));
+        }
+        writeAt(h.facesOffset, a.faces, uint64_t(a.numFaces) * 3 * sizeof(int32_t));
+        writeAt(h.maskOffset, a.mask, uint64_t(a.numMask) * sizeof(int32_t));
+        writeAt(h.landmarkFacesOffset, a.landmarkFaces, uint64_t(a.numLandmarks) * sizeof(int32_t));
+        writeAt(h.landmarkBaryOffset, a.landmarkBarycentrics, uint64_t(a.numLandmarks) * 3 * sizeof(double));
+        if (!out) throw std::runtime_error("write_flame_cache: write failed for " + tmpPath);
+    }
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("write_flame_cache: cannot rename " + tmpPath + " to " + path);
+}
+
+// Read-only shared mapping of a cache file. The mapping lives as long as the object; FlameModel
+// keeps a shared_ptr to it so that its Eigen maps stay valid.
+class MappedFlameCache {
+public:
+    static std::shared_ptr<MappedFlameCache> open(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("flame cache: cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || uint64_t(st.st_size) < sizeof(FlameCacheHeader)) {
+            ::close(fd);
+            throw std::runtime_error("flame cache: " + path + " is too small");
+        }
+        void* base = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) throw std::runtime_error("flame cache: mmap failed for " + path);
+
+        std::shared_ptr<MappedFlameCache> cache(new MappedFlameCache(base, size_t(st.st_size)));
+        cache->validate(path);
+        return cache;
+    }
+
+    ~MappedFlameCache() { munmap(base_, size_); }
+    MappedFlameCache(const MappedFlameCache&) = delete;
+    MappedFlameCache& operator=(const MappedFlameCache&) = delete;
+
+    const FlameCacheHeader& header() const { return *static_cast<const FlameCacheHeader*>(base_); }
+
+    FlameCacheArrays arrays() const {
+        const FlameCacheHeader& h = header();
+        FlameCacheArrays a;
+        a.numVertices        = int(h.numVertices);
+        a.numShapeParameters = int(h.numShapeParameters);
+        a.numFaces           = int(h.numFaces);
+        a.numMask            = int(h.numMask);
+        a.numLandmarks       = int(h.numLandmarks);
+        a.templateVertices   = section<double>(h.templateOffset);
+        if (h.shapeDirWordSize == 8) a.shapeDirections      = section<double>(h.shapeDirOffset);
+        else                         a.shapeDirectionsFloat = section<float>(h.shapeDirOffset);
+        a.faces                = section<int32_t>(h.facesOffset);
+        a.mask                 = section<int32_t>(h.maskOffset);
+        a.landmarkFaces        = section<int32_t>(h.landmarkFacesOffset);
+        a.landmarkBarycentrics = section<double>(h.landmarkBaryOffset);
+        return a;
+    }
+
+private:
+    MappedFlameCache(void* base, size_t size) : base_(base), size_(size) {}
+
+    template <typename T>
+    const T* section(uint64_t offset) const {
+        return reinterpret_cast<const T*>(static_cast<const char*>(base_) + offset);
+    }
+
+    void validate(const std::string& path) const {
+        const FlameCacheHeader& h = header();
+        if (std::memcmp(h.magic, FLAME_CACHE_MAGIC, 8) != 0) throw std::runtime_error("flame cache: " + path + " is not a FLAME cache");
+        if (h.version != FLAME_CACHE_VERSION || h.headerSize != sizeof(FlameCacheHeader))
+            throw std::runtime_error("flame cache: " + path + " has version " + std::to_string(h.version) +
+                                     ", expected " + std::to_string(FLAME_CACHE_VERSION) + "; rebuild it with build_flame_cache");
+        if (h.fileSize != size_) throw std::runtime_error("flame cache: " + path + " is truncated");
+        if (h.shapeDirWordSize != 4 && h.shapeDirWordSize != 8) throw std::runtime_error("flame cache: bad shapedirs word size in " + path);
+
+        const uint64_t rows = uint64_t(h.numVertices) * 3;
+        const struct { uint64_t offset, bytes; } sections[] = {
+            {h.templateOffset,      rows * sizeof(double)},
+            {h.shapeDirOffset,      rows * h.numShapeParameters * h.shapeDirWordSize},
+            {h.facesOffset,         uint64_t(h.numFaces) * 3 * sizeof(int32_t)},
+            {h.maskOffset,          uint64_t(h.numMask) * sizeof(int32_t)},
+            {h.landmarkFacesOffset, uint64_t(h.numLandmarks) * sizeof(int32_t)},
+            {h.landmarkBaryOffset,  uint64_t(h.numLandmarks) * 3 * sizeof(double)},
+        };
+        for (const auto& s : sections)
+            if (s.offset % FLAME_CACHE_ALIGNMENT != 0 || s.offset < sizeof(FlameCacheHeader) || s.offset + s.bytes > size_)
+                throw std::runtime_error("flame cache: corrupt section table in " + path);
+    }
+
+    void* base_;
+    size_t size_;
+};
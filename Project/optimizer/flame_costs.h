@@ -0,0 +1,208 @@
+#pragma once
+
+// 解析雅可比的残差项
+// FLAME 顶点关于 betas 是线性的：p_v(β) = t_v + S_v β，其中 S_v 是 shapedirs 中顶点 v 的 3xB 行块。
+// 所以每个残差的雅可比就是（加权后的）S_v 本身，是常量，不需要用 400 维的 Jet 做自动微分。
+// shapedirs 的布局和优化器里的 shapeDirections 一致：第 (v*3 + c) 行，B 列，行主序。
+// 目标点 q 不拷贝，只存指向共享目标点云（3 x N，列主序 float）那一列的指针，求解期间点云必须一直有效。
+
+#include <cmath>
+#include <Eigen/Dense>
+#include <ceres/ceres.h>
+#include "distance_field.h"
+
+using RowMatrixXd = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+// 点到点残差：r = w * (t_v + S_v β - q)
+class P2PointAnalyticCost : public ceres::CostFunction {
+public:
+    P2PointAnalyticCost(const Eigen::Vector3d& templateVertex, const double* shapeDirRows, int numShapeParameters,
+                        const float* targetPoint, double weight)
+      : templateVertex_(templateVertex), shapeDirRows_(shapeDirRows), numShapeParameters_(numShapeParameters),
+        targetPoint_(targetPoint), weight_(weight) {
+        set_num_residuals(3);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        Eigen::Map<const RowMatrixXd> S(shapeDirRows_, 3, numShapeParameters_);
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], numShapeParameters_);
+
+        Eigen::Map<Eigen::Vector3d> r(residuals);
+        r = weight_ * (templateVertex_ + S * betas - Eigen::Map<const Eigen::Vector3f>(targetPoint_).cast<double>());
+
+        // ceres 的雅可比是行主序 (num_residuals x block_size)，和 shapedirs 行块布局相同
+        if (jacobians != nullptr && jacobians[0] != nullptr) {
+            Eigen::Map<RowMatrixXd>(jacobians[0], 3, numShapeParameters_) = weight_ * S;
+        }
+        return true;
+    }
+
+private:
+    Eigen::Vector3d templateVertex_;
+    const double* shapeDirRows_; // 指向 shapeDirections 中第 vi*3 行，不拥有
+    int numShapeParameters_;
+    const float* targetPoint_;   // 指向目标点云中匹配到的那一列，不拥有
+    double weight_;
+};
+
+// 点到面残差：r = w * n·(t_v + S_v β - q)
+class P2PlaneAnalyticCost : public ceres::CostFunction {
+public:
+    P2PlaneAnalyticCost(const Eigen::Vector3d& templateVertex, const double* shapeDirRows, int numShapeParameters,
+                        const float* targetPoint, const Eigen::Vector3d& normal, double weight)
+      : templateVertex_(templateVertex), shapeDirRows_(shapeDirRows), numShapeParameters_(numShapeParameters),
+        targetPoint_(targetPoint), normal_(normal), weight_(weight) {
+        set_num_residuals(1);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        Eigen::Map<const RowMatrixXd> S(shapeDirRows_, 3, numShapeParameters_);
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], numShapeParameters_);
+
+        // nᵀS 只有一行，先算出来，残差和雅可比都用它
+        Eigen::RowVectorXd nS = weight_ * (normal_.transpose() * S);
+        const Eigen::Vector3d q = Eigen::Map<const Eigen::Vector3f>(targetPoint_).cast<double>();
+        residuals[0] = weight_ * normal_.dot(templateVertex_ - q) + nS.dot(betas);
+
+        if (jacobians != nullptr && jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::RowVectorXd>(jacobians[0], numShapeParameters_) = nS;
+        }
+        return true;
+    }
+
+private:
+    Eigen::Vector3d templateVertex_;
+    const double* shapeDirRows_;
+    int numShapeParameters_;
+    const float* targetPoint_;
+    Eigen::Vector3d normal_;
+    double weight_;
+};
+
+// 表面点残差（反向对应）：扫描点 q 匹配到 FLAME 三角形 (v_0, v_1, v_2) 上重心坐标为 b 的点
+//     s(β) = Σ_k b_k (t_k + S_k β)
+// 前 3 个残差是点到点 w_p (s - q)，第 4 个是点到面 w_n nᵀ(s - q)，n 是这一轮的三角形法线。
+// 雅可比是三个顶点 shapedirs 行块的重心组合 Σ_k b_k S_k。
+class SurfacePointAnalyticCost : public ceres::CostFunction {
+public:
+    SurfacePointAnalyticCost(const Eigen::Vector3d templateVertices[3], const double* const shapeDirRows[3],
+                             const Eigen::Vector3d& barycentric, int numShapeParameters,
+                             const float* targetPoint, const Eigen::Vector3d& normal,
+                             double weightPoint, double weightPlane)
+      : barycentric_(barycentric), numShapeParameters_(numShapeParameters), targetPoint_(targetPoint),
+        normal_(normal), weightPoint_(weightPoint), weightPlane_(weightPlane) {
+        templatePoint_.setZero();
+        for (int k = 0; k < 3; ++k) {
+            templatePoint_ += barycentric(k) * templateVertices[k];
+            shapeDirRows_[k] = shapeDirRows[k];
+        }
+        set_num_residuals(4);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    // 每次调用（每个扫描点、每次 LM 评估）都不分配内存：Σ_k b_k S_k 不单独存，残差是三个 3 行 GEMV 的重心组合，
+    // 雅可比直接写进 ceres 的缓冲区
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        using ShapeRows = Eigen::Map<const Eigen::Matrix<double, 3, Eigen::Dynamic, Eigen::RowMajor>>;
+        const ShapeRows S0(shapeDirRows_[0], 3, numShapeParameters_);
+        const ShapeRows S1(shapeDirRows_[1], 3, numShapeParameters_);
+        const ShapeRows S2(shapeDirRows_[2], 3, numShapeParameters_);
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], numShapeParameters_);
+
+        Eigen::Vector3d e = templatePoint_ - Eigen::Map<const Eigen::Vector3f>(targetPoint_).cast<double>();
+        e.noalias() += barycentric_(0) * (S0 * betas);
+        e.noalias() += barycentric_(1) * (S1 * betas);
+        e.noalias() += barycentric_(2) * (S2 * betas);
+        Eigen::Map<Eigen::Vector3d> r(residuals);
+        r = weightPoint_ * e;
+        residuals[3] = weightPlane_ * normal_.dot(e);
+
+        if (jacobians != nullptr && jacobians[0] != nullptr) {
+            Eigen::Map<RowMatrixXd> J(jacobians[0], 4, numShapeParameters_);
+            J.topRows(3) = (weightPoint_ * barycentric_(0)) * S0 + (weightPoint_ * barycentric_(1)) * S1
+                         + (weightPoint_ * barycentric_(2)) * S2;
+            const Eigen::Vector3d n = weightPlane_ * normal_;
+            J.row(3) = (barycentric_(0) * n.transpose()) * S0 + (barycentric_(1) * n.transpose()) * S1
+                     + (barycentric_(2) * n.transpose()) * S2;
+        }
+        return true;
+    }
+
+private:
+    Eigen::Vector3d templatePoint_; // Σ_k b_k t_k
+    const double* shapeDirRows_[3]; // 三个顶点在 shapeDirections 中的行块，不拥有
+    Eigen::Vector3d barycentric_;
+    int numShapeParameters_;
+    const float* targetPoint_;      // 扫描点在目标点云中的那一列，不拥有
+    Eigen::Vector3d normal_;
+    double weightPoint_;
+    double weightPlane_;
+};
+
+// 距离场残差：r = w * d(t_v + S_v β)，d 是目标点云预先算好的截断有符号距离场（三线性插值）
+// 雅可比 = w * ∇d(p)ᵀ S_v。顶点落在距离场之外时残差取截断值、雅可比为 0，
+// 这样顶点离开距离场不会让代价变小。
+class DistanceFieldCost : public ceres::CostFunction {
+public:
+    DistanceFieldCost(const Eigen::Vector3d& templateVertex, const double* shapeDirRows, int numShapeParameters,
+                      const TargetDistanceField& field, double weight)
+      : templateVertex_(templateVertex), shapeDirRows_(shapeDirRows), numShapeParameters_(numShapeParameters),
+        field_(field), weight_(weight) {
+        set_num_residuals(1);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        Eigen::Map<const RowMatrixXd> S(shapeDirRows_, 3, numShapeParameters_);
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], numShapeParameters_);
+        const Eigen::Vector3d p = templateVertex_ + S * betas;
+
+        double distance;
+        Eigen::Vector3d gradient;
+        if (!field_.sample(p, distance, gradient)) {
+            distance = field_.band();
+            gradient.setZero();
+        }
+        residuals[0] = weight_ * distance;
+
+        if (jacobians != nullptr && jacobians[0] != nullptr) {
+            Eigen::Map<Eigen::RowVectorXd>(jacobians[0], numShapeParameters_) = weight_ * (gradient.transpose() * S);
+        }
+        return true;
+    }
+
+private:
+    Eigen::Vector3d templateVertex_;
+    const double* shapeDirRows_;
+    int numShapeParameters_;
+    const TargetDistanceField& field_;
+    double weight_;
+};
+
+// β 的正则化残差项：r = sqrt(λ) β，雅可比是 sqrt(λ) I
+class RegularizationAnalyticCost : public ceres::CostFunction {
+public:
+    RegularizationAnalyticCost(double lambda, int numShapeParameters)
+      : sqrtLambda_(std::sqrt(lambda)), numShapeParameters_(numShapeParameters) {
+        set_num_residuals(numShapeParameters);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], numShapeParameters_);
+        Eigen::Map<Eigen::VectorXd>(residuals, numShapeParameters_) = sqrtLambda_ * betas;
+
+        if (jacobians != nullptr && jacobians[0] != nullptr) {
+            Eigen::Map<RowMatrixXd> J(jacobians[0], numShapeParameters_, numShapeParameters_);
+            J.setZero();
+            J.diagonal().setConstant(sqrtLambda_);
+        }
+        return true;
+    }
+
+private:
+    double sqrtLambda_;
+    int numShapeParameters_;
+};
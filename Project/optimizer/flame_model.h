@@ -0,0 +1,308 @@
+#pragma once
+
+// FLAME shape model shared by the optimizers, the knn tools and read_flame.
+// shapedirs is kept as one contiguous (3V x B) row-major matrix: row (v*3 + c) holds the B
+// blendshape coefficients of coordinate c of vertex v. This is exactly the C-order layout of the
+// (V, 3, B) npz array, so evaluating a mesh is a single GEMV: vertices = v_template + S * betas.
+//
+// templateVertices / shapeDirections are read-only Eigen maps. They point either into buffers
+// inflated from the npz or directly into a memory-mapped .flamecache (see flame_cache.h); storage_
+// keeps whichever backs them alive, so copies of a FlameModel share the same data.
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "npz_reader.h"
+#include "flame_cache.h"
+
+using RowMatrixXd = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+struct FlameModel {
+    int numVertices        = 0;
+    int numShapeParameters = 0;
+
+    Eigen::Map<const Eigen::VectorXd> templateVertices{nullptr, 0};   // 3V: x0 y0 z0 x1 y1 z1 ...
+    Eigen::Map<const RowMatrixXd>     shapeDirections{nullptr, 0, 0}; // 3V x B
+
+    std::vector<Eigen::Vector3i> faces; // empty if the archive has no faces / f array
+    std::vector<int> faceMask;          // vertex indices of the face region, empty unless a mask is given
+    std::vector<int> landmarkFaces;                     // landmark embedding (only stored in the cache)
+    std::vector<Eigen::Vector3d> landmarkBarycentrics;
+
+    FlameModel() = default;
+    FlameModel(const FlameModel& other) { *this = other; }
+
+    // Maps assign coefficients on operator=, so rebind them to the other model's storage instead
+    FlameModel& operator=(const FlameModel& other) {
+        if (this == &other) return *this;
+        numVertices          = other.numVertices;
+        numShapeParameters   = other.numShapeParameters;
+        faces                = other.faces;
+        faceMask             = other.faceMask;
+        landmarkFaces        = other.landmarkFaces;
+        landmarkBarycentrics = other.landmarkBarycentrics;
+        bind(other.storage_, other.templateVertices.data(), other.shapeDirections.data());
+        return *this;
+    }
+
+    // Load a FLAME model. modelPath may be an npz or a .flamecache; for an npz, a .flamecache with
+    // the same stem that is at least as new is mapped instead. The optional vertex mask (array
+    // maskName of a second npz) is only read if the cache does not already contain one.
+    static FlameModel load(const std::string& modelPath, const std::string& maskPath = "", const std::string& maskName = "face") {
+        std::string cachePath;
+        if (is_flame_cache(modelPath)) cachePath = modelPath;
+        else if (flame_cache_is_fresh(flame_cache_path(modelPath), modelPath)) cachePath = flame_cache_path(modelPath);
+        if (cachePath.empty()) return load_npz(modelPath, maskPath, maskName);
+
+        FlameModel model = load_cache(cachePath);
+        if (model.faceMask.empty() && !maskPath.empty()) model.faceMask = read_npz_array<int>(maskPath, maskName);
+        return model;
+    }
+
+    // Map a .flamecache. Double shapedirs are used in place (zero-copy, shared page cache between
+    // processes); a float cache is widened once into owned buffers. Faces, mask and landmarks are small
+    // and copied.
+    static FlameModel load_cache(const std::string& cachePath) {
+        std::shared_ptr<MappedFlameCache> cache = MappedFlameCache::open(cachePath);
+        const FlameCacheArrays a = cache->arrays();
+
+        FlameModel model;
+        model.numVertices        = a.numVertices;
+        model.numShapeParameters = a.numShapeParameters;
+        static_assert(sizeof(Eigen::Vector3i) == 3 * sizeof(int32_t), "Vector3i must be three packed ints");
+        model.faces.resize(a.numFaces);
+        std::memcpy(static_cast<void*>(model.faces.data()), a.faces, size_t(a.numFaces) * 3 * sizeof(int32_t));
+        model.faceMask.assign(a.mask, a.mask + a.numMask);
+        model.landmarkFaces.assign(a.landmarkFaces, a.landmarkFaces + a.numLandmarks);
+        for (int l = 0; l < a.numLandmarks; ++l)
+            model.landmarkBarycentrics.emplace_back(a.landmarkBarycentrics[3 * l], a.landmarkBarycentrics[3 * l + 1], a.landmarkBarycentrics[3 * l + 2]);
+
+        if (a.shapeDirections != nullptr) {
+            model.bind(cache, a.templateVertices, a.shapeDirections);
+        } else {
+            const Eigen::Index rows = 3 * Eigen::Index(a.numVertices);
+            auto owned = std::make_shared<OwnedShape>();
+            owned->templateVertices = Eigen::Map<const Eigen::VectorXd>(a.templateVertices, rows);
+            owned->shapeDirections  = Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>(
+                                          a.shapeDirectionsFloat, rows, a.numShapeParameters).cast<double>();
+            model.bind(owned, owned->templateVertices.data(), owned->shapeDirections.data());
+        }
+        return model;
+    }
+
+    // Load v_template, shapedirs and faces ("faces" or "f") from the model archive, and optionally the
+    // vertex mask array maskName from a second archive. Each archive is opened and scanned once, the
+    // compressed members are read in one pass, and the arrays are inflated straight into their final
+    // buffers: shapedirs (V, 3, B) in C order is already the 3V x B row-major layout.
+    // The parallelism is per member only: a deflate stream has no restart points, so shapedirs, which
+    // is nearly all of the bytes, is still inflated by one thread and bounds the load time. The gain is
+    // the single archive scan and the missing copies; run build_flame_cache to skip inflation entirely.
+    static FlameModel load_npz(const std::string& modelPath, const std::string& maskPath = "", const std::string& maskName = "face") {
+        NpzArchive archive(modelPath);
+        std::vector<std::string> names = {"v_template", "shapedirs"};
+        const std::string facesName = archive.contains("faces") ? "faces" : (archive.contains("f") ? "f" : "");
+        if (!facesName.empty()) names.push_back(facesName);
+        std::vector<NpzMember> members = archive.fetch(names);
+        if (!maskPath.empty()) members.push_back(std::move(NpzArchive(maskPath).fetch({maskName})[0]));
+
+        FlameModel model;
+        auto owned = std::make_shared<OwnedShape>();
+        std::vector<NpyHeader> headers(members.size());
+        std::vector<std::string> errors(members.size());
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int m = 0; m < int(members.size()); ++m) {
+            try {
+                NpyStream stream(members[m]);
+                const NpyHeader& h = stream.header();
+                headers[m] = h;
+                if (m == 0) {
+                    if (h.shape.size() != 2 || h.shape[1] != 3) throw std::runtime_error("Unexpected v_template shape");
+                    owned->templateVertices.resize(Eigen::Index(h.num_values()));
+                    stream.read_values(owned->templateVertices.data(), h.num_values());
+                } else if (m == 1) {
+                    if (h.shape.size() != 3 || h.shape[1] != 3) throw std::runtime_error("Unexpected shapedirs shape");
+                    owned->shapeDirections.resize(Eigen::Index(h.shape[0] * 3), Eigen::Index(h.shape[2]));
+                    stream.read_values(owned->shapeDirections.data(), h.num_values());
+                } else if (m == 2 && !facesName.empty()) {
+                    if (h.shape.size() != 2 || h.shape[1] != 3) throw std::runtime_error("Unexpected faces shape");
+                    static_assert(sizeof(Eigen::Vector3i) == 3 * sizeof(int32_t), "Vector3i must be three packed ints");
+                    model.faces.resize(h.shape[0]);
+                    stream.read_values(reinterpret_cast<int32_t*>(model.faces.data()), h.num_values());
+                } else {
+                    model.faceMask.resize(h.num_values());
+                    stream.read_values(model.faceMask.data(), h.num_values());
+                }
+            } catch (const std::exception& e) {
+                errors[m] = e.what();
+            }
+        }
+        for (const auto& e : errors)
+            if (!e.empty()) throw std::runtime_error(e);
+
+        if (headers[1].shape[0] != headers[0].shape[0]) throw std::runtime_error("Unexpected shapedirs shape");
+        model.numVertices        = int(headers[0].shape[0]);
+        model.numShapeParameters = int(headers[1].shape[2]);
+        model.bind(owned, owned->templateVertices.data(), owned->shapeDirections.data());
+        return model;
+    }
+
+    // Raw views of all arrays, for write_flame_cache()
+    FlameCacheArrays cache_arrays() const {
+        FlameCacheArrays a;
+        a.numVertices          = numVertices;
+        a.numShapeParameters   = numShapeParameters;
+        a.numFaces             = int(faces.size());
+        a.numMask              = int(faceMask.size());
+        a.numLandmarks         = int(landmarkFaces.size());
+        a.templateVertices     = templateVertices.data();
+        a.shapeDirections      = shapeDirections.data();
+        a.faces                = reinterpret_cast<const int32_t*>(faces.data());
+        a.mask                 = faceMask.data();
+        a.landmarkFaces        = landmarkFaces.data();
+        a.landmarkBarycentrics = landmarkBarycentrics.empty() ? nullptr : landmarkBarycentrics[0].data();
+        return a;
+    }
+
+    Eigen::Vector3d template_vertex(int v) const { return templateVertices.segment<3>(3 * v); }
+
+    // Pointer to the 3 x B block S_v of vertex v (rows v*3 .. v*3+2)
+    const double* shape_dir_rows(int v) const { return shapeDirections.data() + size_t(v) * 3 * numShapeParameters; }
+
+private:
+    struct OwnedShape {
+        Eigen::VectorXd templateVertices;
+        RowMatrixXd     shapeDirections;
+    };
+
+    void bind(std::shared_ptr<const void> storage, const double* templateData, const double* shapeDirData) {
+        storage_ = std::move(storage);
+        new (&templateVertices) Eigen::Map<const Eigen::VectorXd>(templateData, 3 * Eigen::Index(numVertices));
+        new (&shapeDirections) Eigen::Map<const RowMatrixXd>(shapeDirData, 3 * Eigen::Index(numVertices), numShapeParameters);
+    }
+
+    std::shared_ptr<const void> storage_;
+};
+
+// vertices = v_template + S * betas (3V, xyz interleaved). The GEMV is split into row blocks
+// that are evaluated in parallel; each block is a vectorized Eigen matrix-vector product.
+inline void compute_shape_vertices(const FlameModel& model, const double* betas, Eigen::VectorXd& vertices) {
+    const int rows = 3 * model.numVertices;
+    const int blockRows = 1536; // 512 vertices per block
+    Eigen::Map<const Eigen::VectorXd> b(betas, model.numShapeParameters);
+
+    vertices.resize(rows);
+    #pragma omp parallel for schedule(static)
+    for (int r0 = 0; r0 < rows; r0 += blockRows) {
+        const int n = std::min(blockRows, rows - r0);
+        vertices.segment(r0, n) = model.templateVertices.segment(r0, n);
+        vertices.segment(r0, n).noalias() += model.shapeDirections.middleRows(r0, n) * b;
+    }
+}
+
+inline Eigen::VectorXd compute_shape_vertices(const FlameModel& model, const std::vector<double>& betas) {
+    if (int(betas.size()) != model.numShapeParameters)
+        throw std::runtime_error("Beta size mismatch: expected " + std::to_string(model.numShapeParameters) +
+                                 ", got " + std::to_string(betas.size()));
+    Eigen::VectorXd vertices;
+    compute_shape_vertices(model, betas.data(), vertices);
+    return vertices;
+}
+
+// Evaluate many meshes at once: column j of the result (3V x N) is v_template + S * betas.col(j).
+// One (3V x B) * (B x N) GEMM streams shapedirs through the cache once for all N meshes instead of
+// once per mesh; Eigen splits the GEMM over the OpenMP threads itself.
+inline Eigen::MatrixXd compute_shape_vertices_batch(const FlameModel& model, const Eigen::MatrixXd& betas) {
+    if (betas.rows() != model.numShapeParameters)
+        throw std::runtime_error("Beta size mismatch: expected " + std::to_string(model.numShapeParameters) +
+                                 ", got " + std::to_string(betas.rows()));
+    Eigen::MatrixXd vertices(3 * model.numVertices, betas.cols());
+    vertices.noalias() = model.shapeDirections * betas;
+    vertices.colwise() += model.templateVertices;
+    return vertices;
+}
+
+// 3V xyz-interleaved vertices as the 3xN float matrix used by the knn search
+inline Eigen::MatrixXf to_point_matrix(const Eigen::VectorXd& vertices) {
+    return Eigen::Map<const Eigen::MatrixXd>(vertices.data(), 3, vertices.size() / 3).cast<float>();
+}
+
+// Apply shape blendshapes: v_template + shapedirs * betas, as a 3xN float matrix for the knn search
+inline Eigen::MatrixXf apply_shape_blendshape(const FlameModel& model, const std::vector<double>& betas) {
+    return to_point_matrix(compute_shape_vertices(model, betas));
+}
+
+// Vertex buffer of one subject that is kept alive between ICP rounds.
+// update() only applies S * (betas - appliedBetas) over the columns whose delta exceeds
+// deltaThreshold, so the cost is proportional to the number of betas that actually moved.
+// Skipped columns are not lost: their delta stays pending in appliedBetas and is applied once it
+// grows past the threshold. Every reanchorInterval incremental updates the buffer is recomputed
+// from scratch to drop accumulated floating-point drift.
+class FlameShapeState {
+public:
+    explicit FlameShapeState(const FlameModel& model, double deltaThreshold = 1e-5, int reanchorInterval = 5)
+      : model_(model), deltaThreshold_(deltaThreshold), reanchorInterval_(reanchorInterval),
+        appliedBetas_(model.numShapeParameters, 0.0), vertices_(model.templateVertices) {}
+
+    const Eigen::VectorXd& update(const std::vector<double>& betas) {
+        const int B = model_.numShapeParameters;
+        if (int(betas.size()) != B)
+            throw std::runtime_error("Beta size mismatch: expected " + std::to_string(B) + ", got " + std::to_string(betas.size()));
+
+        std::vector<int> columns;
+        std::vector<double> deltas;
+        for (int k = 0; k < B; ++k) {
+            const double delta = betas[k] - appliedBetas_[k];
+            if (std::abs(delta) > deltaThreshold_) {
+                columns.push_back(k);
+                deltas.push_back(delta);
+            }
+        }
+        lastActiveColumns_ = int(columns.size());
+        if (columns.empty()) return vertices_;
+
+        // Once most columns moved the sparse gather is no cheaper than the dense GEMV
+        if (2 * int(columns.size()) > B || ++updatesSinceAnchor_ >= reanchorInterval_) {
+            reanchor(betas);
+            return vertices_;
+        }
+
+        const int rows = 3 * model_.numVertices;
+        const int K = int(columns.size());
+        #pragma omp parallel for schedule(static)
+        for (int r = 0; r < rows; ++r) {
+            const double* row = model_.shapeDirections.data() + size_t(r) * B;
+            double acc = 0.0;
+            for (int j = 0; j < K; ++j) acc += row[columns[j]] * deltas[j];
+            vertices_(r) += acc;
+        }
+        for (int j = 0; j < K; ++j) appliedBetas_[columns[j]] = betas[columns[j]];
+        return vertices_;
+    }
+
+    // Full recompute: vertices = v_template + S * betas
+    void reanchor(const std::vector<double>& betas) {
+        appliedBetas_ = betas;
+        compute_shape_vertices(model_, appliedBetas_.data(), vertices_);
+        updatesSinceAnchor_ = 0;
+    }
+
+    const Eigen::VectorXd& vertices() const { return vertices_; }
+    int last_active_columns() const { return lastActiveColumns_; }
+
+private:
+    const FlameModel& model_;
+    double deltaThreshold_;
+    int reanchorInterval_;
+    int updatesSinceAnchor_ = 0;
+    int lastActiveColumns_  = 0;
+    std::vector<double> appliedBetas_;
+    Eigen::VectorXd vertices_;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+// optimize / optimize_face_only / optimize_plane 共用的 ICP 设置
+// 收敛判断、ceres 线性求解器、由粗到细的 betas 阶段、对应点搜索方式和 warm start 的默认值只在这里写一次；
+// 每个优化器从 IcpSettings 的默认值开始，只改和默认不同的几项（比如 optimize_plane 最多跑 7 轮）。
+// 只有某一个优化器用到的开关（法方程、对称匹配、距离场等）仍然留在它自己的文件顶部。
+
+#include <vector>
+#include "convergence.h"
+#include "solver_policy.h"
+#include "beta_stages.h"
+#include "correspondence.h"
+
+struct IcpSettings {
+    // 收敛判断（默认值见 ConvergenceSettings）：
+    //   betaTolerance        一轮里betas的相对变化 ||Δβ||/||β|| 小于这个算没有改进
+    //   distanceTolerance    对应点平均距离的相对下降小于这个、
+    //   inlierTolerance      并且匹配数的相对增加也小于这个，也算没有改进
+    //   patience             连续这么多轮没有改进就提前停
+    //   minRounds/maxRounds  至少 / 最多跑这么多轮
+    //   firstInnerIterations 第一轮ceres LM最多迭代次数，之后每轮翻倍，最多 maxInnerIterations 次（前几轮不需要解到底）
+    ConvergenceSettings convergence;
+
+    // ceres的线性求解器：Auto按残差行数、活跃betas个数和条件数上界在DENSE_NORMAL_CHOLESKY / DENSE_QR / CGNR里选（每次求解按当轮的λ重选），其余为强制
+    LinearSolverChoice linearSolver = LinearSolverChoice::Auto;
+    // true: 第一次求解和每次活跃betas个数变化时三种线性求解器各解一遍，打印时间和最终代价，Auto时改用代价不差里最快的
+    bool benchmarkLinearSolvers = false;
+
+    // true: 由粗到细，第1、2、…轮只解前betaStages[k]个betas（其余固定为0），之后的轮次用最后一个
+    bool useBetaStages = false;
+    std::vector<int> betaStages = {20, 50, 100, 400}; // 每一轮激活的betas个数，只增不减
+
+    // KDTree：目标点云的KD树只建一次，每轮以max_distance为半径查询；Projective：顶点投影到深度图上在窗口内找（只有optimize_plane有深度图）；
+    // VoxelHash：格子边长为max_distance的哈希网格，每个顶点最多查27格；BruteForce：每轮暴力搜索
+    CorrespondenceMode correspondenceMode = CorrespondenceMode::KDTree;
+    // >0: 每个顶点缓存上一次完整搜索时周围的目标点，移动不超过这个距离就只在缓存里找（结果不变），只在KDTree模式下有效；0关闭
+    float warmStartSlack = 0.0005f;
+    // BruteForce模式的指令集：Best按CPU自动选AVX-512/AVX2，Scalar为不用SIMD的对照
+    SimdLevel bruteForceSimd = SimdLevel::Best;
+
+    // 第 iteration 轮（从 1 开始）激活的betas个数，没打开由粗到细时是全部
+    int active_betas(int iteration, int numShapeParameters) const {
+        if (!useBetaStages) return numShapeParameters;
+        return stage_active_betas(betaStages.data(), int(betaStages.size()), iteration - 1, numShapeParameters);
+    }
+};
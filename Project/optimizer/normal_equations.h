@@ -0,0 +1,352 @@
+#pragma once
+
+// 法方程直接求解
+// 每一轮 ICP 里残差关于 betas 是线性的、正则项是 Tikhonov，所以整个问题是线性最小二乘：
+//     min_β  Σ ||w_p (t_v + S_v β - q)||² + Σ (w_n nᵀ(t_v + S_v β - q))² + λ||β||²
+// 直接组装 (JᵀJ + λI) β = Jᵀb，然后做一次 Cholesky 就得到和 LM 收敛后相同的解。
+
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <cstddef>
+#include <Eigen/Dense>
+#include <omp.h>
+#include "flame_model.h"
+#include "surface_correspondence.h"
+#include "correspondence_buffer.h"
+
+struct ShapeNormalEquations {
+    Eigen::MatrixXd JtJ; // B x B，只有下三角有效
+    Eigen::VectorXd Jtb; // B
+
+    explicit ShapeNormalEquations(int numShapeParameters)
+      : JtJ(Eigen::MatrixXd::Zero(numShapeParameters, numShapeParameters)),
+        Jtb(Eigen::VectorXd::Zero(numShapeParameters)) {}
+};
+
+// 把一组对应点的残差加进法方程，不含正则项
+// 第 i 个匹配是 flame 顶点 matches[i].flameIndex 和目标点 matches.target(i)，两项权重都再乘 matches[i].weight
+// vertexNormals 为空时只加点到点项
+// numActive >= 0 时只组装前 numActive 个 betas 的左上角块（由粗到细模式，其余 betas 是 0）
+inline void add_shape_normal_equations(ShapeNormalEquations& eq,
+                                       const FlameModel& model,
+                                       const CorrespondenceBuffer& matches,
+                                       const std::vector<Eigen::Vector3d>& vertexNormals,
+                                       double weightPoint,
+                                       double weightPlane,
+                                       int numActive = -1) {
+    const int numShapeParameters = model.numShapeParameters;
+    const int B = numActive < 0 ? numShapeParameters : std::min(numActive, numShapeParameters);
+    const int numMatches = matches.size();
+    const bool usePlane = !vertexNormals.empty();
+    const int rowsPerMatch = usePlane ? 4 : 3;
+    const int chunkSize = 64; // 每次把 64 个匹配的行堆起来做一次 rank update（SYRK）
+
+    #pragma omp parallel
+    {
+        Eigen::MatrixXd localJtJ = Eigen::MatrixXd::Zero(B, B);
+        Eigen::VectorXd localJtb = Eigen::VectorXd::Zero(B);
+        RowMatrixXd A(chunkSize * rowsPerMatch, B);
+        Eigen::VectorXd b(chunkSize * rowsPerMatch);
+
+        #pragma omp for schedule(static)
+        for (int start = 0; start < numMatches; start += chunkSize) {
+            const int count = std::min(chunkSize, numMatches - start);
+
+            for (int j = 0; j < count; ++j) {
+                const int i  = start + j;
+                const int vi = matches[i].flameIndex;
+                const auto S = Eigen::Map<const RowMatrixXd>(model.shape_dir_rows(vi), 3, numShapeParameters).leftCols(B);
+                const Eigen::Vector3d d = Eigen::Map<const Eigen::Vector3f>(matches.target(i)).cast<double>()
+                                        - model.template_vertex(vi); // q - t
+                const double m = matches[i].weight;
+
+                // 点到点：w_p S_v β = w_p (q - t)
+                A.middleRows(j * rowsPerMatch, 3) = m * weightPoint * S;
+                b.segment<3>(j * rowsPerMatch) = m * weightPoint * d;
+
+                // 点到面：w_n nᵀS_v β = w_n nᵀ(q - t)
+                if (usePlane) {
+                    const Eigen::Vector3d& n = vertexNormals[vi];
+                    A.row(j * rowsPerMatch + 3) = m * weightPlane * (n.transpose() * S);
+                    b(j * rowsPerMatch + 3) = m * weightPlane * n.dot(d);
+                }
+            }
+
+            const int rows = count * rowsPerMatch;
+            localJtJ.selfadjointView<Eigen::Lower>().rankUpdate(A.topRows(rows).transpose());
+            localJtb.noalias() += A.topRows(rows).transpose() * b.head(rows);
+        }
+
+        #pragma omp critical
+        {
+            eq.JtJ.topLeftCorner(B, B).triangularView<Eigen::Lower>() += localJtJ;
+            eq.Jtb.head(B) += localJtb;
+        }
+    }
+}
+
+// 组装法方程：一组对应点的残差加正则项（numActive 同 add_shape_normal_equations）
+inline ShapeNormalEquations assemble_shape_normal_equations(const FlameModel& model,
+                                                            const CorrespondenceBuffer& matches,
+                                                            const std::vector<Eigen::Vector3d>& vertexNormals,
+                                                            double weightPoint,
+                                                            double weightPlane,
+                                                            double lambda,
+                                                            int numActive = -1) {
+    ShapeNormalEquations eq(model.numShapeParameters);
+    add_shape_normal_equations(eq, model, matches, vertexNormals, weightPoint, weightPlane, numActive);
+
+    // 正则项 λ||β||²
+    eq.JtJ.diagonal().array() += lambda;
+    return eq;
+}
+
+// 反向对应（扫描点 → FLAME 表面点）的残差加进法方程，不含正则项
+// 表面点 s_q(β) = Σ_k b_k (t_k + S_k β)，残差 w_p (s_q - q) 和 w_n nᵀ(s_q - q)，n 是三角形法线。
+// 同一个三角形上所有扫描点的 n 相同，令 P = w_p² I + w_n² n nᵀ，d_q = q - Σ_k b_k t_k：
+//     JᵀJ += Σ_q S_qᵀ P S_q = Uᵀ (A ⊗ P) U,   A = Σ_q b bᵀ (3x3),   U = [S_0; S_1; S_2] (9 x B)
+//     Jᵀb += Σ_k S_kᵀ P h_k,                 h_k = Σ_q b_k d_q
+// 所以先把扫描点按三角形累加成 A 和 h，每个三角形只做一次 9 行的 rank update，和扫描点数无关。
+// A ⊗ P 按两边各自的特征分解拆成 9 行：sqrt(α_i π_j) Σ_k a_i[k] p_jᵀ S_k。
+// numActive 同 add_shape_normal_equations：只组装前 numActive 个 betas 的左上角块
+inline void add_surface_normal_equations(ShapeNormalEquations& eq,
+                                         const FlameModel& model,
+                                         const FlameSurfaceBVH& surface,
+                                         const std::vector<SurfaceMatch>& matches,
+                                         const Eigen::MatrixXf& scanPoints,
+                                         double weightPoint,
+                                         double weightPlane,
+                                         int numActive = -1) {
+    const int numShapeParameters = model.numShapeParameters;
+    const int B = numActive < 0 ? numShapeParameters : std::min(numActive, numShapeParameters);
+    const std::vector<Eigen::Vector3i>& faces = surface.faces();
+    const int chunkSize = 16; // 每批 16 个三角形、144 行做一次 rank update
+
+    // 1. 按三角形累加 A 和 h
+    std::vector<int> faceSlot(faces.size(), -1);
+    std::vector<int> activeFaces;
+    std::vector<Eigen::Matrix3d> A;
+    std::vector<Eigen::Matrix3d> h; // 第 k 列是 h_k
+    for (int q = 0; q < int(matches.size()); ++q) {
+        const int f = matches[q].face;
+        if (f < 0) continue;
+        if (faceSlot[f] < 0) {
+            faceSlot[f] = int(activeFaces.size());
+            activeFaces.push_back(f);
+            A.push_back(Eigen::Matrix3d::Zero());
+            h.push_back(Eigen::Matrix3d::Zero());
+        }
+        const Eigen::Vector3d b = matches[q].barycentric.cast<double>();
+        Eigen::Vector3d d = scanPoints.col(q).cast<double>();
+        for (int k = 0; k < 3; ++k) d -= b(k) * model.template_vertex(faces[f][k]);
+        A[faceSlot[f]] += b * b.transpose();
+        h[faceSlot[f]] += d * b.transpose();
+    }
+
+    // 2. 每个三角形 9 行
+    const int numFaces = int(activeFaces.size());
+    #pragma omp parallel
+    {
+        Eigen::MatrixXd localJtJ = Eigen::MatrixXd::Zero(B, B);
+        Eigen::VectorXd localJtb = Eigen::VectorXd::Zero(B);
+        RowMatrixXd rows(chunkSize * 9, B);
+        RowMatrixXd pS(3, B);
+
+        #pragma omp for schedule(static)
+        for (int start = 0; start < numFaces; start += chunkSize) {
+            const int count = std::min(chunkSize, numFaces - start);
+            for (int j = 0; j < count; ++j) {
+                const int slot = start + j;
+                const Eigen::Vector3i& face = faces[activeFaces[slot]];
+                const Eigen::Vector3d n = surface.face_normal(activeFaces[slot]).cast<double>();
+
+                // P 的特征向量：n（特征值 w_p² + w_n²）和两个垂直方向（w_p²）
+                Eigen::Matrix3d p;
+                p.col(0) = n;
+                p.col(1) = n.unitOrthogonal();
+                p.col(2) = n.cross(p.col(1));
+                const Eigen::Vector3d pi(weightPoint * weightPoint + weightPlane * weightPlane,
+                                         weightPoint * weightPoint, weightPoint * weightPoint);
+                const Eigen::Matrix3d P = p * pi.asDiagonal() * p.transpose();
+
+                const Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigA(A[slot]);
+                for (int i = 0; i < 3; ++i) {
+                    const double alpha = std::max(eigA.eigenvalues()(i), 0.0);
+                    const Eigen::Vector3d a = eigA.eigenvectors().col(i);
+                    pS.setZero();
+                    for (int k = 0; k < 3; ++k)
+                        pS.noalias() += a(k) * (p.transpose() * Eigen::Map<const RowMatrixXd>(model.shape_dir_rows(face[k]), 3, numShapeParameters).leftCols(B));
+                    for (int jp = 0; jp < 3; ++jp)
+                        rows.row(j * 9 + i * 3 + jp) = std::sqrt(alpha * pi(jp)) * pS.row(jp);
+                }
+                for (int k = 0; k < 3; ++k)
+                    localJtb.noalias() += Eigen::Map<const RowMatrixXd>(model.shape_dir_rows(face[k]), 3, numShapeParameters).leftCols(B).transpose() * (P * h[slot].col(k));
+            }
+            localJtJ.selfadjointView<Eigen::Lower>().rankUpdate(rows.topRows(count * 9).transpose());
+        }
+
+        #pragma omp critical
+        {
+            eq.JtJ.topLeftCorner(B, B).triangularView<Eigen::Lower>() += localJtJ;
+            eq.Jtb.head(B) += localJtb;
+        }
+    }
+}
+
+// 解 (JᵀJ + λI) β = Jᵀb，先用 LLT，数值上不正定时退回 LDLT
+// numActive >= 0 时只解左上角 numActive x numActive 块，后面的 betas 置 0（由粗到细模式）
+inline bool solve_shape_normal_equations(const ShapeNormalEquations& eq, std::vector<double>& betas, int numActive = -1) {
+    const int B = int(eq.Jtb.size());
+    const int K = numActive < 0 ? B : std::min(numActive, B);
+    const auto JtJ = eq.JtJ.topLeftCorner(K, K);
+    Eigen::VectorXd solution;
+
+    Eigen::LLT<Eigen::MatrixXd, Eigen::Lower> llt(JtJ);
+    if (llt.info() == Eigen::Success) {
+        solution = llt.solve(eq.Jtb.head(K));
+    } else {
+        Eigen::LDLT<Eigen::MatrixXd, Eigen::Lower> ldlt(JtJ);
+        if (ldlt.info() != Eigen::Success) return false;
+        solution = ldlt.solve(eq.Jtb.head(K));
+    }
+
+    betas.assign(B, 0.0);
+    std::copy(solution.data(), solution.data() + K, betas.begin());
+    return true;
+}
+
+
+// —— 每个顶点的 Gram 矩阵缓存 ——
+// 顶点 v 对点到点部分 JᵀJ 的贡献永远是 G_v = S_vᵀS_v，和这一轮匹配到哪个目标点无关。
+// G_v 只存因子形式：就是 S_v 的三行，累加时攒一批做 rank update，不额外占内存；另外缓存所有顶点的总和 Σ_v G_v，
+// 匹配上的顶点超过一半时改成 总和 - Σ_未匹配 G_v，只需要处理较少的那部分顶点。
+// （不存完整的 400x400 块：每块约 640KB，加一块要读的内存比 rank-3 update 的计算还慢。）
+// 点到面部分 S_vᵀnnᵀS_v 依赖这一轮的法线，只有一行 nᵀS_v，每轮现算。
+struct ShapeGramCache {
+    int numVertices        = 0;
+    int numShapeParameters = 0;
+    Eigen::MatrixXd totalGram; // Σ_v S_vᵀS_v，只有下三角有效
+};
+
+// 模型加载后建一次缓存
+inline ShapeGramCache build_shape_gram_cache(const FlameModel& model) {
+    const int numVertices = model.numVertices;
+    const int B = model.numShapeParameters;
+
+    ShapeGramCache cache;
+    cache.numVertices        = numVertices;
+    cache.numShapeParameters = B;
+
+    // 所有顶点的总和就是整个 shapedirs 的 SᵀS，一次 SYRK
+    cache.totalGram = Eigen::MatrixXd::Zero(B, B);
+    cache.totalGram.selfadjointView<Eigen::Lower>().rankUpdate(model.shapeDirections.transpose());
+    return cache;
+}
+
+// Σ_{v in vertices} G_v 的下三角，按顶点并行求和，每个线程自己的累加器最后合并
+inline Eigen::MatrixXd sum_vertex_grams(const ShapeGramCache& cache, const FlameModel& model,
+                                        const std::vector<int>& vertices) {
+    const int B = cache.numShapeParameters;
+    const int numSummed = int(vertices.size());
+    const int chunkSize = 64;
+
+    Eigen::MatrixXd gram = Eigen::MatrixXd::Zero(B, B);
+
+    #pragma omp parallel
+    {
+        Eigen::MatrixXd localGram = Eigen::MatrixXd::Zero(B, B);
+        RowMatrixXd A(chunkSize * 3, B);
+
+        #pragma omp for schedule(static)
+        for (int start = 0; start < numSummed; start += chunkSize) {
+            const int count = std::min(chunkSize, numSummed - start);
+            // 把 S_v 三行堆起来，攒够一批做一次 rank update
+            for (int j = 0; j < count; ++j) {
+                A.middleRows(3 * j, 3) = Eigen::Map<const RowMatrixXd>(model.shape_dir_rows(vertices[start + j]), 3, B);
+            }
+            localGram.selfadjointView<Eigen::Lower>().rankUpdate(A.topRows(3 * count).transpose());
+        }
+
+        #pragma omp critical
+        gram.triangularView<Eigen::Lower>() += localGram;
+    }
+    return gram;
+}
+
+// 用缓存组装法方程，结果和 assemble_shape_normal_equations 相同
+// 点到点部分所有匹配共用一个权重，所以每个匹配自己的权重都必须是 1；有重复顶点时不走"总和减未匹配"的捷径
+inline ShapeNormalEquations assemble_shape_normal_equations_cached(const ShapeGramCache& cache,
+                                                                   const FlameModel& model,
+                                                                   const CorrespondenceBuffer& matches,
+                                                                   const std::vector<Eigen::Vector3d>& vertexNormals,
+                                                                   double weightPoint,
+                                                                   double weightPlane,
+                                                                   double lambda) {
+    const int B = cache.numShapeParameters;
+    const int V = cache.numVertices;
+    const int numMatches = matches.size();
+    const bool usePlane = !vertexNormals.empty();
+    const int chunkSize = 64;
+    if (!matches.uniform_weight(1.0f)) throw std::runtime_error("Gram cache needs the same weight for every match");
+
+    ShapeNormalEquations eq(B);
+
+    // 1. 点到点部分：w_p² Σ_matched G_v，匹配多于一半时用总和减去未匹配的
+    std::vector<int> indexList(numMatches);
+    std::vector<char> matched(V, 0);
+    int numUnique = 0;
+    for (int i = 0; i < numMatches; ++i) {
+        const int vi = indexList[i] = matches[i].flameIndex;
+        if (!matched[vi]) ++numUnique;
+        matched[vi] = 1;
+    }
+    if (numUnique == numMatches && 2 * numMatches > V) {
+        std::vector<int> unmatched;
+        for (int v = 0; v < V; ++v) if (!matched[v]) unmatched.push_back(v);
+        eq.JtJ.triangularView<Eigen::Lower>() = cache.totalGram - sum_vertex_grams(cache, model, unmatched);
+    } else {
+        eq.JtJ.triangularView<Eigen::Lower>() = sum_vertex_grams(cache, model, indexList);
+    }
+    eq.JtJ.triangularView<Eigen::Lower>() *= weightPoint * weightPoint;
+
+    // 2. 点到面部分（每个匹配一行 nᵀS_v）和右端项 Jᵀb
+    #pragma omp parallel
+    {
+        Eigen::MatrixXd localJtJ = Eigen::MatrixXd::Zero(B, B);
+        Eigen::VectorXd localJtb = Eigen::VectorXd::Zero(B);
+        RowMatrixXd A(chunkSize, B);
+
+        #pragma omp for schedule(static)
+        for (int start = 0; start < numMatches; start += chunkSize) {
+            const int count = std::min(chunkSize, numMatches - start);
+            for (int j = 0; j < count; ++j) {
+                const int i  = start + j;
+                const int vi = indexList[i];
+                Eigen::Map<const RowMatrixXd> S(model.shape_dir_rows(vi), 3, B);
+                const Eigen::Vector3d d = Eigen::Map<const Eigen::Vector3f>(matches.target(i)).cast<double>()
+                                        - model.template_vertex(vi); // q - t
+
+                // S_vᵀ (w_p² d + w_n² n nᵀd)
+                Eigen::Vector3d rhs = weightPoint * weightPoint * d;
+                if (usePlane) {
+                    const Eigen::Vector3d& n = vertexNormals[vi];
+                    rhs += weightPlane * weightPlane * n.dot(d) * n;
+                    A.row(j) = weightPlane * (n.transpose() * S);
+                }
+                localJtb.noalias() += S.transpose() * rhs;
+            }
+            if (usePlane) localJtJ.selfadjointView<Eigen::Lower>().rankUpdate(A.topRows(count).transpose());
+        }
+
+        #pragma omp critical
+        {
+            eq.JtJ.triangularView<Eigen::Lower>() += localJtJ;
+            eq.Jtb += localJtb;
+        }
+    }
+
+    // 正则项 λ||β||²
+    eq.JtJ.diagonal().array() += lambda;
+    return eq;
+}
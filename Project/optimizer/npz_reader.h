@@ -0,0 +1,323 @@
+#pragma once
+
+// Minimal single-pass .npz reader used by FlameModel::load().
+// cnpy::npz_load(path, name) reopens and rescans the zip for every array and returns a heap copy
+// that the caller copies again. Here the central directory is parsed once, the compressed bytes of
+// all requested members are read in one sequential pass over the file, and each member is then
+// inflated (raw deflate, as written by np.savez_compressed; stored members from np.savez are copied)
+// straight into the caller's destination buffer. Members are independent, so callers can inflate
+// them in parallel; a single member is always inflated serially (a deflate stream cannot be split).
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <zlib.h>
+
+struct NpyHeader {
+    char typeChar = 0;        // 'f', 'i' or 'u'
+    int wordSize  = 0;        // bytes per element
+    bool fortranOrder = false;
+    std::vector<size_t> shape;
+
+    size_t num_values() const {
+        size_t n = 1;
+        for (size_t s : shape) n *= s;
+        return n;
+    }
+};
+
+// Compressed bytes of one member, as read from the archive
+struct NpzMember {
+    std::string name;                 // array name without the ".npy" suffix
+    uint16_t method = 0;              // 0 = stored, 8 = deflate
+    uint64_t compressedSize   = 0;
+    uint64_t uncompressedSize = 0;
+    uint64_t localHeaderOffset = 0;
+    std::vector<unsigned char> data;
+};
+
+namespace npz_detail {
+
+inline uint16_t read_u16(const unsigned char* p) { return uint16_t(p[0] | (p[1] << 8)); }
+inline uint32_t read_u32(const unsigned char* p) { return uint32_t(read_u16(p)) | (uint32_t(read_u16(p + 2)) << 16); }
+inline uint64_t read_u64(const unsigned char* p) { return uint64_t(read_u32(p)) | (uint64_t(read_u32(p + 4)) << 32); }
+
+// Parse the python dict of a .npy header: {'descr': '<f8', 'fortran_order': False, 'shape': (5023, 3), }
+inline NpyHeader parse_npy_dict(const std::string& dict, const std::string& name) {
+    NpyHeader header;
+
+    size_t pos = dict.find("'descr'");
+    if (pos == std::string::npos) throw std::runtime_error("npz: missing descr in " + name);
+    pos = dict.find('\'', pos + 7);
+    if (pos == std::string::npos || pos + 3 >= dict.size()) throw std::runtime_error("npz: bad descr in " + name);
+    const char byteOrder = dict[pos + 1];
+    if (byteOrder == '>') throw std::runtime_error("npz: big-endian array " + name + " is not supported");
+    header.typeChar = dict[pos + 2];
+    header.wordSize = std::atoi(dict.c_str() + pos + 3);
+
+    pos = dict.find("'fortran_order'");
+    if (pos == std::string::npos) throw std::runtime_error("npz: missing fortran_order in " + name);
+    header.fortranOrder = dict.compare(dict.find(':', pos) + 1, 5, " True") == 0;
+
+    pos = dict.find("'shape'");
+    if (pos == std::string::npos) throw std::runtime_error("npz: missing shape in " + name);
+    const size_t open = dict.find('(', pos), close = dict.find(')', pos);
+    if (open == std::string::npos || close == std::string::npos) throw std::runtime_error("npz: bad shape in " + name);
+    for (size_t p = open + 1; p < close;) {
+        while (p < close && (dict[p] < '0' || dict[p] > '9')) ++p;
+        if (p >= close) break;
+        header.shape.push_back(size_t(std::strtoull(dict.c_str() + p, nullptr, 10)));
+        while (p < close && dict[p] >= '0' && dict[p] <= '9') ++p;
+    }
+    return header;
+}
+
+template <typename T> struct NpyType;
+template <> struct NpyType<double>   { static constexpr char type = 'f'; };
+template <> struct NpyType<float>    { static constexpr char type = 'f'; };
+template <> struct NpyType<int32_t>  { static constexpr char type = 'i'; };
+template <> struct NpyType<int64_t>  { static constexpr char type = 'i'; };
+template <> struct NpyType<uint32_t> { static constexpr char type = 'u'; };
+template <> struct NpyType<uint64_t> { static constexpr char type = 'u'; };
+
+template <typename Src, typename Dst>
+inline void convert_values(const unsigned char* src, Dst* dst, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        Src v;
+        std::memcpy(&v, src + i * sizeof(Src), sizeof(Src));
+        dst[i] = static_cast<Dst>(v);
+    }
+}
+
+} // namespace npz_detail
+
+// Incremental reader of one member: header() is available right after construction,
+// read() then pulls the next bytes of the array payload into the caller's buffer.
+class NpyStream {
+public:
+    explicit NpyStream(const NpzMember& member) : member_(member) {
+        if (member_.method == 8) {
+            std::memset(&zs_, 0, sizeof(zs_));
+            if (inflateInit2(&zs_, -MAX_WBITS) != Z_OK) throw std::runtime_error("npz: inflateInit failed for " + member_.name);
+            zs_.next_in  = const_cast<unsigned char*>(member_.data.data());
+            zs_.avail_in = uInt(member_.data.size());
+            inflating_ = true;
+        } else if (member_.method != 0) {
+            throw std::runtime_error("npz: unsupported compression method " + std::to_string(member_.method) + " in " + member_.name);
+        }
+
+        unsigned char preamble[12];
+        read_raw(preamble, 10);
+        if (std::memcmp(preamble, "\x93NUMPY", 6) != 0) throw std::runtime_error("npz: " + member_.name + " is not a .npy array");
+        size_t dictLength = npz_detail::read_u16(preamble + 8);
+        if (preamble[6] >= 2) { // version 2/3 use a 4 byte header length
+            read_raw(preamble + 10, 2);
+            dictLength = npz_detail::read_u32(preamble + 8);
+        }
+        std::string dict(dictLength, '\0');
+        read_raw(&dict[0], dictLength);
+        header_ = npz_detail::parse_npy_dict(dict, member_.name);
+        if (header_.fortranOrder) throw std::runtime_error("npz: fortran-ordered array " + member_.name + " is not supported");
+    }
+
+    ~NpyStream() { if (inflating_) inflateEnd(&zs_); }
+    NpyStream(const NpyStream&) = delete;
+    NpyStream& operator=(const NpyStream&) = delete;
+
+    const NpyHeader& header() const { return header_; }
+
+    // Read the whole payload as T. If the stored dtype is T itself the bytes go straight into dst,
+    // otherwise they are converted chunk by chunk.
+    template <typename T>
+    void read_values(T* dst, size_t count) {
+        if (count != header_.num_values())
+            throw std::runtime_error("npz: " + member_.name + " holds " + std::to_string(header_.num_values()) +
+                                     " values, expected " + std::to_string(count));
+        if (header_.typeChar == npz_detail::NpyType<T>::type && header_.wordSize == int(sizeof(T))) {
+            read_raw(dst, count * sizeof(T));
+            return;
+        }
+        const size_t chunk = 1 << 14;
+        std::vector<unsigned char> buffer(chunk * header_.wordSize);
+        for (size_t i0 = 0; i0 < count; i0 += chunk) {
+            const size_t n = std::min(chunk, count - i0);
+            read_raw(buffer.data(), n * header_.wordSize);
+            convert(buffer.data(), dst + i0, n);
+        }
+    }
+
+private:
+    void read_raw(void* dst, size_t bytes) {
+        unsigned char* out = static_cast<unsigned char*>(dst);
+        if (!inflating_) {
+            if (position_ + bytes > member_.data.size()) throw std::runtime_error("npz: truncated member " + member_.name);
+            std::memcpy(out, member_.data.data() + position_, bytes);
+            position_ += bytes;
+            return;
+        }
+        while (bytes > 0) {
+            // avail_out is a 32-bit count, so very large payloads are inflated in slices
+            const size_t slice = std::min<size_t>(bytes, 1u << 30);
+            zs_.next_out  = out;
+            zs_.avail_out = uInt(slice);
+            while (zs_.avail_out > 0) {
+                const int ret = inflate(&zs_, Z_NO_FLUSH);
+                if (ret == Z_STREAM_END && zs_.avail_out > 0) throw std::runtime_error("npz: truncated member " + member_.name);
+                if (ret != Z_OK && ret != Z_STREAM_END) throw std::runtime_error("npz: inflate failed for " + member_.name);
+            }
+            out += slice;
+            bytes -= slice;
+        }
+    }
+
+    template <typename T>
+    void convert(const unsigned char* src, T* dst, size_t n) const {
+        using namespace npz_detail;
+        switch (header_.typeChar * 16 + header_.wordSize) {
+            case 'f' * 16 + 4: convert_values<float>(src, dst, n);    return;
+            case 'f' * 16 + 8: convert_values<double>(src, dst, n);   return;
+            case 'i' * 16 + 4: convert_values<int32_t>(src, dst, n);  return;
+            case 'i' * 16 + 8: convert_values<int64_t>(src, dst, n);  return;
+            case 'u' * 16 + 4: convert_values<uint32_t>(src, dst, n); return;
+            case 'u' * 16 + 8: convert_values<uint64_t>(src, dst, n); return;
+        }
+        throw std::runtime_error("npz: unsupported dtype " + std::string(1, header_.typeChar) +
+                                 std::to_string(header_.wordSize) + " in " + member_.name);
+    }
+
+    const NpzMember& member_;
+    NpyHeader header_;
+    z_stream zs_;
+    bool inflating_  = false;
+    size_t position_ = 0;
+};
+
+// Central directory of one .npz archive. The file stays open so that fetch() can read the members
+// without reopening it.
+class NpzArchive {
+public:
+    explicit NpzArchive(const std::string& path) : path_(path), file_(path, std::ios::binary) {
+        if (!file_) throw std::runtime_error("npz: cannot open " + path);
+        read_central_directory();
+    }
+
+    bool contains(const std::string& name) const { return entries_.count(name) > 0; }
+
+    // Read the compressed bytes of the requested members in file order (one forward pass)
+    std::vector<NpzMember> fetch(const std::vector<std::string>& names) {
+        std::vector<NpzMember> members;
+        for (const auto& name : names) {
+            auto it = entries_.find(name);
+            if (it == entries_.end()) throw std::runtime_error("npz: array '" + name + "' not found in " + path_);
+            members.push_back(it->second);
+        }
+        std::vector<size_t> order(members.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return members[a].localHeaderOffset < members[b].localHeaderOffset;
+        });
+
+        for (size_t i : order) {
+            NpzMember& m = members[i];
+            unsigned char local[30];
+            file_.seekg(std::streamoff(m.localHeaderOffset));
+            file_.read(reinterpret_cast<char*>(local), 30);
+            if (!file_ || npz_detail::read_u32(local) != 0x04034b50) throw std::runtime_error("npz: bad local header in " + path_);
+            const uint64_t dataOffset = m.localHeaderOffset + 30 + npz_detail::read_u16(local + 26) + npz_detail::read_u16(local + 28);
+
+            m.data.resize(m.compressedSize);
+            file_.seekg(std::streamoff(dataOffset));
+            file_.read(reinterpret_cast<char*>(m.data.data()), std::streamsize(m.compressedSize));
+            if (!file_) throw std::runtime_error("npz: truncated archive " + path_);
+        }
+        return members;
+    }
+
+private:
+    void read_central_directory() {
+        using namespace npz_detail;
+        file_.seekg(0, std::ios::end);
+        const uint64_t fileSize = uint64_t(file_.tellg());
+
+        // End of central directory record: 22 bytes plus an optional comment of up to 64 KiB
+        const uint64_t tailSize = std::min<uint64_t>(fileSize, 22 + 0xFFFF);
+        std::vector<unsigned char> tail(tailSize);
+        file_.seekg(std::streamoff(fileSize - tailSize));
+        file_.read(reinterpret_cast<char*>(tail.data()), std::streamsize(tailSize));
+        if (!file_ || tailSize < 22) throw std::runtime_error("npz: cannot read " + path_);
+
+        int64_t eocd = int64_t(tailSize) - 22;
+        while (eocd >= 0 && read_u32(&tail[eocd]) != 0x06054b50) --eocd;
+        if (eocd < 0) throw std::runtime_error("npz: " + path_ + " is not a zip archive");
+
+        uint64_t numEntries = read_u16(&tail[eocd + 10]);
+        uint64_t cdSize     = read_u32(&tail[eocd + 12]);
+        uint64_t cdOffset   = read_u32(&tail[eocd + 16]);
+
+        // Zip64 end of central directory, located through the 20 byte locator right before the EOCD
+        if ((numEntries == 0xFFFF || cdOffset == 0xFFFFFFFF) && eocd >= 20 && read_u32(&tail[eocd - 20]) == 0x07064b50) {
+            unsigned char rec[56];
+            file_.seekg(std::streamoff(read_u64(&tail[eocd - 20 + 8])));
+            file_.read(reinterpret_cast<char*>(rec), 56);
+            if (!file_ || read_u32(rec) != 0x06064b50) throw std::runtime_error("npz: bad zip64 record in " + path_);
+            numEntries = read_u64(rec + 32);
+            cdSize     = read_u64(rec + 40);
+            cdOffset   = read_u64(rec + 48);
+        }
+
+        std::vector<unsigned char> cd(cdSize);
+        file_.seekg(std::streamoff(cdOffset));
+        file_.read(reinterpret_cast<char*>(cd.data()), std::streamsize(cdSize));
+        if (!file_) throw std::runtime_error("npz: cannot read the central directory of " + path_);
+
+        size_t p = 0;
+        for (uint64_t e = 0; e < numEntries; ++e) {
+            if (p + 46 > cd.size() || read_u32(&cd[p]) != 0x02014b50) throw std::runtime_error("npz: bad central directory in " + path_);
+            NpzMember m;
+            m.method            = read_u16(&cd[p + 10]);
+            m.compressedSize    = read_u32(&cd[p + 20]);
+            m.uncompressedSize  = read_u32(&cd[p + 24]);
+            const size_t nameLength = read_u16(&cd[p + 28]), extraLength = read_u16(&cd[p + 30]), commentLength = read_u16(&cd[p + 32]);
+            m.localHeaderOffset = read_u32(&cd[p + 42]);
+            std::string name(reinterpret_cast<const char*>(&cd[p + 46]), nameLength);
+
+            // Zip64 extended information: 8 byte values for exactly the fields saturated above
+            for (size_t x = p + 46 + nameLength; x + 4 <= p + 46 + nameLength + extraLength;) {
+                const uint16_t id = read_u16(&cd[x]), size = read_u16(&cd[x + 2]);
+                if (id == 0x0001) {
+                    size_t f = x + 4;
+                    if (m.uncompressedSize  == 0xFFFFFFFF) { m.uncompressedSize  = read_u64(&cd[f]); f += 8; }
+                    if (m.compressedSize    == 0xFFFFFFFF) { m.compressedSize    = read_u64(&cd[f]); f += 8; }
+                    if (m.localHeaderOffset == 0xFFFFFFFF) { m.localHeaderOffset = read_u64(&cd[f]); }
+                }
+                x += 4 + size;
+            }
+            p += 46 + nameLength + extraLength + commentLength;
+
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".npy") == 0) name.resize(name.size() - 4);
+            m.name = name;
+            entries_[name] = m;
+        }
+    }
+
+    std::string path_;
+    std::ifstream file_;
+    std::map<std::string, NpzMember> entries_;
+};
+
+// Convenience for small arrays (masks, landmark embeddings): read one array of an archive as T
+template <typename T>
+inline std::vector<T> read_npz_array(const std::string& path, const std::string& name, std::vector<size_t>* shape = nullptr) {
+    NpzArchive archive(path);
+    std::vector<NpzMember> members = archive.fetch({name});
+    NpyStream stream(members[0]);
+    std::vector<T> values(stream.header().num_values());
+    stream.read_values(values.data(), values.size());
+    if (shape != nullptr) *shape = stream.header().shape;
+    return values;
+}
@@ -8,186 +8,95 @@
 #include <cstring>
 #include <Eigen/Dense>
 #include <ceres/ceres.h>
-#include "cnpy.h"
+#include "flame_model.h"
+#include "flame_costs.h"
+#include "icp_settings.h"
+#include "correspondence.h"
+#include "correspondence_buffer.h"
+#include "normal_equations.h"
+#include "symmetric_correspondence.h"
+#include "persistent_problem.h"
 #include <limits>
+#include <memory>
 #include <omp.h>
 using MatrixXf = Eigen::MatrixXf;
 using Vector3f = Eigen::Vector3f;
 
 
 // —— 全局变量 ——
-static Eigen::MatrixXd              templateVertices; // mean脸的模版顶点
-static std::vector<double>          shapeDirections; // 形变方向
+static FlameModel shapeModel; // mean脸的模版顶点 + 形变方向（3V x B）
 static std::vector<double>          shapeParameters; // 形变参数（betas）
 static std::vector<Eigen::Vector3i> faces; // 
 static std::vector<Eigen::Vector3d> vertex_normals; // 法线容器（在calculateNorms方法里自动初始化
-static std::vector<int>             indexList; // 存放index of matched flame vertices
 static int numVertices         = -1;
 static int numShapeParameters  = -1;
 static int numFaces            = -1;
 static int ITERATION           = 1; //用来记录这是第几轮优化（loss+knn算一轮）
-static const int MAX_ITERATION = 7; // 设置一共跑几轮
+// ICP 设置（收敛判断、线性求解器、由粗到细、对应点搜索），默认值见 icp_settings.h，这里只改不同的
+static IcpSettings icp_settings() {
+    IcpSettings s;
+    s.convergence.maxRounds = 7; // 最多跑几轮（收敛了会提前停）
+    return s;
+}
+static const IcpSettings SETTINGS = icp_settings();
+static IcpConvergence convergence(SETTINGS.convergence);
+static LinearSolverPolicy solverPolicy(SETTINGS.linearSolver, SETTINGS.benchmarkLinearSolvers);
+static const bool USE_NORMAL_EQUATIONS = true; // true: 每轮直接解法方程（一次Cholesky）；false: 用ceres LM求解
+static const bool BATCHED_CERES_COST = true; // ceres模式下这一轮的所有匹配合成一个残差块（只含匹配上的顶点，一次并行算完全部残差和雅可比）；false: 每个顶点一个残差块
+static const bool USE_GRAM_CACHE = true; // 法方程模式下用预计算的每顶点Gram缓存组装JᵀJ
+static const double SHAPE_DELTA_THRESHOLD = 1e-5; // 每轮更新网格时，变化量小于这个值的beta先不更新
+static const int SHAPE_REANCHOR_INTERVAL = 5; // 增量更新这么多次之后整体重算一次网格，消除累积误差
+static const float APPROXIMATE_EPS_SCHEDULE[] = {1.0f, 0.5f, 0.25f, 0.1f}; // KDTree模式第1、2、…轮的近似系数eps（匹配点最多比最近点远1+eps倍），之后的轮次精确搜索（近似的轮次不走warm start缓存）
+static const bool MEASURE_RECALL = false; // true: eps>0的轮次再精确搜一遍，打印近似搜索的召回率（找到真正最近点的比例），用来调eps
+static const int NORMAL_FILTER_CANDIDATES = 1; // >1: 每个顶点取max_distance内最近的k个扫描点，选第一个法线和顶点法线兼容的（避免匹配到耳朵、鼻翼背面）；1表示只取最近点不看法线
+static const float NORMAL_FILTER_MAX_ANGLE = 60.0f; // 法线过滤时顶点法线和扫描点PCA法线的最大夹角（度）
+static const int PROJECTIVE_WINDOW_RADIUS = 2; // Projective模式下投影点周围搜索的像素半径（窗口为 (2r+1)x(2r+1)）
+static const bool USE_DISTANCE_FIELD = false; // true: 目标点云预先算成截断距离场，每轮不找对应点，所有顶点直接在距离场上取残差
+static const float DISTANCE_FIELD_RESOLUTION = 0.001f; // 距离场体素大小（1mm）
+static const float DISTANCE_FIELD_BAND = 0.005f; // 距离场截断带宽，只在扫描表面这个距离以内建体素
+static const bool USE_SYMMETRIC_CORRESPONDENCES = false; // true: 顶点→扫描点之外再加扫描点→最近FLAME顶点的反向匹配，顶点BVH只建一次，之后每轮refit
+static const double SYMMETRIC_FORWARD_WEIGHT = 1.0; // 对称模式下正向（顶点→扫描点）残差的权重倍数
+static const double SYMMETRIC_REVERSE_WEIGHT = 1.0; // 对称模式下反向（扫描点→顶点）残差的权重倍数
+static const bool SYMMETRIC_REVERSE_PER_POINT = true; // true: 反向每个扫描点算一份（同一顶点的扫描点合并成均值，权重乘sqrt(个数)）；false: 每个被匹配的顶点只算一份
+static const bool USE_SURFACE_CORRESPONDENCES = false; // true: 反向匹配，每个扫描点找变形后FLAME表面上的最近点（三角形+重心坐标），代替顶点→扫描点的knn；三角形BVH只建一次，之后每轮refit
 
 // —— knn用到的结构 ——
-struct KNN_Result{
-    Eigen::MatrixXf source;
-    Eigen::MatrixXf nn_points;
-    std::vector<int> flame_indices;
-};
-
 struct Flame_Mesh{
-    const cnpy::NpyArray& v_template_arr;
-    const cnpy::NpyArray& shapedirs_arr;
+    FlameShapeState& shape_state; // 跨轮保存的顶点缓存，只按 betas 的变化量增量更新
     const std::vector<double>& betas;
 
-    Flame_Mesh(const cnpy::NpyArray& v, const cnpy::NpyArray& s, const std::vector<double>& b)
-    : v_template_arr(v), shapedirs_arr(s), betas(b) {}
-};
-
-// β 的正则化残差项
-struct RegularizationCost {
-    RegularizationCost(double lambda, int n_params)
-        : lambda_(lambda), n_params_(n_params) {}
-
-    template <typename T>
-    bool operator()(T const* const* parameters, T* residuals) const {
-        const T* beta = parameters[0];
-        for (int i = 0; i < n_params_; ++i) {
-            residuals[i] = T(std::sqrt(lambda_)) * beta[i];
-        }
-        return true;
-    }
-
-private:
-    double lambda_;
-    int n_params_;
-};
-
-
-// 点到点残差
-struct P2PointResidual {
-    P2PointResidual(int vertexIndex, const Eigen::Vector3d &targetPoint, const double weight)
-      : vertexIndex_(vertexIndex), targetPoint_(targetPoint), weight_(weight) {}
-
-    template <typename T>
-    bool operator()(T const* const* parameters, T* residuals) const {
-        const T* betas = parameters[0];
-
-        // 模板顶点
-        T px = T(templateVertices(vertexIndex_, 0));
-        T py = T(templateVertices(vertexIndex_, 1));
-        T pz = T(templateVertices(vertexIndex_, 2));
-
-        // 叠加形变
-        for (int k = 0; k < numShapeParameters; ++k) {
-            T beta = betas[k];
-            px += T(shapeDirections[(vertexIndex_ * 3 + 0)*numShapeParameters + k]) * beta;
-            py += T(shapeDirections[(vertexIndex_ * 3 + 1)*numShapeParameters + k]) * beta;
-            pz += T(shapeDirections[(vertexIndex_ * 3 + 2)*numShapeParameters + k]) * beta;
-        }
-
-        residuals[0] = T(weight_) * (px - T(targetPoint_(0)));
-        residuals[1] = T(weight_) * (py - T(targetPoint_(1)));
-        residuals[2] = T(weight_) * (pz - T(targetPoint_(2)));
-        return true;
-    }
-
-    int vertexIndex_;
-    Eigen::Vector3d targetPoint_;
-    double weight_;
-};
-
-// 点到面残差
-struct P2PlaneResidual {
-    P2PlaneResidual(int vertexIndex, const Eigen::Vector3d &targetPoint, const Eigen::Vector3d &normal, const double weight)
-      : vertexIndex_(vertexIndex), targetPoint_(targetPoint), normal_(normal), weight_(weight) {}
-
-    template <typename T>
-    bool operator()(T const* const* parameters, T* residuals) const {
-    
-        // 先复用点到点计算(这里设置权重为1.0，因为外围还有点到面权重)
-        P2PointResidual p2p(vertexIndex_, targetPoint_, 1.0);
-        T p2pt[3];
-        p2p(parameters, p2pt);
-
-        // 点到面残差 = (p - q)·n
-        residuals[0] = T(weight_) * (T(normal_.x()) * p2pt[0] + T(normal_.y()) * p2pt[1] + T(normal_.z()) * p2pt[2]);
-        return true;
-    }
-
-    int vertexIndex_;
-    Eigen::Vector3d targetPoint_;
-    Eigen::Vector3d normal_;
-    double weight_;
+    Flame_Mesh(FlameShapeState& s, const std::vector<double>& b)
+    : shape_state(s), betas(b) {}
 };
 
 // 计算顶点法线（自动初始化法向量容器）
-template <typename T>
-void calculateNormals(const T* shapeParams, std::vector<Eigen::Matrix<T,3,1>>& normals) {
+// vertices 是 compute_shape_vertices 算出来的 3V 顶点坐标
+void calculateNormals(const Eigen::VectorXd& vertices, std::vector<Eigen::Vector3d>& normals) {
     
     if (numVertices == -1) throw std::runtime_error("Not correctly initialize number of vertices yet."); 
 
     // 初始化+清零
-    if (vertex_normals.size() != numVertices) vertex_normals.resize(numVertices);
-    for (auto& n : normals) n.setZero();
+    normals.assign(numVertices, Eigen::Vector3d::Zero());
 
     // 对每个三角面
     for (const auto& f : faces) {
-        Eigen::Matrix<T,3,3> pts;
-        for (int i = 0; i < 3; ++i) {
-            int vi = f[i];
-            // 顶点坐标 + 形变
-            T x = T(templateVertices(vi, 0)),
-              y = T(templateVertices(vi, 1)),
-              z = T(templateVertices(vi, 2));
-            for (int k = 0; k < numShapeParameters; ++k) {
-                T beta = shapeParams[k];
-                x += T(shapeDirections[(vi * 3 + 0) * numShapeParameters + k]) * beta;
-                y += T(shapeDirections[(vi * 3 + 1) * numShapeParameters + k]) * beta;
-                z += T(shapeDirections[(vi * 3 + 2) * numShapeParameters + k]) * beta;
-            }
-            pts.col(i) = Eigen::Matrix<T,3,1>(x,y,z);
-        }
+        const Eigen::Vector3d p0 = vertices.segment<3>(3 * f[0]);
+        const Eigen::Vector3d p1 = vertices.segment<3>(3 * f[1]);
+        const Eigen::Vector3d p2 = vertices.segment<3>(3 * f[2]);
         // 面法线
-        Eigen::Matrix<T,3,1> fn = (pts.col(1) - pts.col(0)).cross(pts.col(2) - pts.col(0));
+        Eigen::Vector3d fn = (p1 - p0).cross(p2 - p0);
         // 累加到对应顶点
         for (int i = 0; i < 3; ++i) normals[f[i]] += fn;
     }
     // 归一化
     for (auto& n : normals) {
-        T norm = n.norm();
-        if (norm > T(1e-8)) n /= norm;
+        double norm = n.norm();
+        if (norm > 1e-8) n /= norm;
     }
 }
 
 
 
-// Apply shape blendshapes: v_template + shapedirs * betas
-MatrixXf apply_shape_blendshape(const cnpy::NpyArray& v_template_arr,
-                                 const cnpy::NpyArray& shapedirs_arr,
-                                 const std::vector<double>& betas) {
-    const double* v_data = v_template_arr.data<double>();
-    const double* s_data = shapedirs_arr.data<double>();
-
-    int N = v_template_arr.shape[0];
-    int B = shapedirs_arr.shape[2];
-
-    MatrixXf vertices(3, N);
-    for (int i = 0; i < N; ++i) {
-        Vector3f v(static_cast<float>(v_data[i * 3 + 0]),
-                   static_cast<float>(v_data[i * 3 + 1]),
-                   static_cast<float>(v_data[i * 3 + 2]));
-        for (int b = 0; b < B; ++b) {
-            v.x() += static_cast<float>(s_data[i * 3 * B + 0 * B + b]) * betas[b];
-            v.y() += static_cast<float>(s_data[i * 3 * B + 1 * B + b]) * betas[b];
-            v.z() += static_cast<float>(s_data[i * 3 * B + 2 * B + b]) * betas[b];
-        }
-        vertices.col(i) = v;
-    }
-    return vertices;
-}
-
-
 void save_matrix_as_txt(const MatrixXf& source, const MatrixXf& nn_points, std::vector<int>& flame_indices){
 
     //flame.txt : source
@@ -256,97 +165,163 @@ MatrixXf load_off_as_matrix(const std::string& filename) {
     return mat;
 }
 
-// Parallel KNN search
-std::vector<int> knn_search_parallel(const MatrixXf& source, const MatrixXf& target) {
-    std::vector<int> nn_indices(source.cols(), -1);
-    #pragma omp parallel for
-    for (int i = 0; i < source.cols(); ++i) {
-        float min_dist = std::numeric_limits<float>::max();
-        int min_j = -1;
-        for (int j = 0; j < target.cols(); ++j) {
-            float dist = (source.col(i) - target.col(j)).squaredNorm();
-            if (dist < min_dist) {
-                min_dist = dist;
-                min_j = j;
-            }
-        }
-        nn_indices[i] = min_j;
-    }
-    return nn_indices;
-}
-
-KNN_Result knn(Flame_Mesh& flame_mesh, const MatrixXf& target, float max_distance){
+// 这一轮的对应点写进 matches（跨轮复用），每个匹配只记 flame 顶点和目标点云的列号，权重都是 weight
+void knn(Flame_Mesh& flame_mesh, const MatrixXf& target, const CorrespondenceEngine& correspondences, float max_distance,
+         float weight, CorrespondenceBuffer& matches){
 
     //Source : FLAME mesh
     //Target : transformed points(our image point cloud)
     //Source changes after each iteration of optimizer
     //Target is fixed
-    //Return : source and nn_points
-
-    // Load FLAME shape model
-    cnpy::NpyArray v_template_arr = flame_mesh.v_template_arr;
-    cnpy::NpyArray shapedirs_arr = flame_mesh.shapedirs_arr;
-    // std::vector<double> betas = flame_mesh.betas;
-    const std::vector<double>& betas = flame_mesh.betas;
-
-    MatrixXf source;
-
-    // Add betas to betas_vector
-    source = apply_shape_blendshape(v_template_arr, shapedirs_arr, betas);
-    
+    //Return : matched (flame vertex, target point) index pairs
 
     // Generate FLAME mesh with shape deformation
+    MatrixXf source = to_point_matrix(flame_mesh.shape_state.update(flame_mesh.betas));
+    std::cout << "Updated FLAME mesh from " << flame_mesh.shape_state.last_active_columns() << " changed betas." << std::endl;
 
 
     // Run parallel KNN matching
     // Source : FLAME mesh
     // Target : transformed points(our image point cloud)
     // knn result : nearest point of source.col(i) in target = target.col(nn_indices[i])
-    std::vector<int> nn_indices = knn_search_parallel(source, target);
-
-    // Build matched point set
-    // nearest point of source.col(i) in target = nn_points.col(i)
-    MatrixXf nn_points(3, source.cols());
-    for (int i = 0; i < source.cols(); ++i)
-        nn_points.col(i) = target.col(nn_indices[i]);
+    // max_distance bounds the search itself; vertices without a match within it get -1
+    // 法线过滤：在 max_distance 内最近的几个扫描点里取第一个法线兼容的，需要当前网格的顶点法线
+    const bool filterByNormal = correspondences.normal_filter_enabled();
+    if (filterByNormal) calculateNormals(flame_mesh.shape_state.vertices(), vertex_normals);
+    const NNBatchResult nn = filterByNormal ? correspondences.match_compatible(source, vertex_normals, max_distance)
+                                            : correspondences.match(source, max_distance);
+    if (MEASURE_RECALL && (correspondences.eps() > 0.0f || correspondences.mode() == CorrespondenceMode::Projective))
+        std::cout << "Correspondence recall (eps " << correspondences.eps() << "): "
+                  << correspondences.measure_recall(source, max_distance, nn) << std::endl;
+    if (correspondences.last_match_warm())
+        std::cout << "Warm start: " << correspondences.warm_hits() << " of " << source.cols() << " vertices matched from cached candidates." << std::endl;
+
+    // Keep the matches within max_distance, compacted in one parallel pass; the target points stay in target
+    compact_matches(nn, target, max_distance, weight, matches);
+}
 
 
-    std::vector<int> flame_indices;
-    // Write filtered matched points and compute distance statistics
-    // save_matrix_as_txt(source, nn_points, flame_indices);
+// 距离场模式下的一轮优化：不需要对应点，每个顶点一个距离场残差，用ceres LM连续优化
+void solve_with_distance_field(const TargetDistanceField& field, double weight, double lambda, int activeBetas) {
+    ceres::Problem problem;
+    problem.AddParameterBlock(shapeParameters.data(), numShapeParameters);
+    for (int vi = 0; vi < numVertices; ++vi) {
+        problem.AddResidualBlock(
+            new DistanceFieldCost(shapeModel.template_vertex(vi), shapeModel.shape_dir_rows(vi), numShapeParameters, field, weight),
+            nullptr, shapeParameters.data());
+    }
+    problem.AddResidualBlock(new RegularizationAnalyticCost(lambda, numShapeParameters), nullptr, shapeParameters.data());
+    if (SETTINGS.useBetaStages) restrict_to_leading_betas(problem, shapeParameters.data(), numShapeParameters, activeBetas);
+
+    ceres::Solver::Options opts;
+    opts.trust_region_strategy_type  = ceres::LEVENBERG_MARQUARDT;
+    opts.minimizer_progress_to_stdout = 1;
+    opts.num_threads                  = 8;
+    opts.max_num_iterations           = convergence.max_inner_iterations();
+
+    ceres::Solver::Summary summary;
+    solverPolicy.solve(opts, problem, lambda, shapeParameters, &summary);
+    std::cout << summary.BriefReport() << std::endl;
+}
 
-    // Apply the same distance filter to create filtered matrices
+// 对称模式：反向匹配（扫描点 → 最近的FLAME顶点，按顶点合并成均值）写进 reverseMatches，
+// 均值点存在 reverse.meanTargets 里（最多 V 列），reverseMatches 的目标点云就是它
+void find_reverse_matches(FlameVertexBVH& vertexIndex, const Eigen::VectorXd& vertices, const MatrixXf& target,
+                          float max_distance, ReverseMatches& reverse, CorrespondenceBuffer& reverseMatches) {
+    double t_start = omp_get_wtime();
+    vertexIndex.update(vertices);
+    reverse = group_reverse_matches(vertexIndex.nearest_vertices(target, max_distance), target, numVertices);
+
+    const int numReverse = int(reverse.vertices.size());
+    reverseMatches.targets = &reverse.meanTargets;
+    reverseMatches.entries.resize(numReverse);
+    int numPoints = 0;
+    for (int i = 0; i < numReverse; ++i) {
+        numPoints += reverse.counts[i];
+        const float weight = float(SYMMETRIC_REVERSE_WEIGHT * (SYMMETRIC_REVERSE_PER_POINT ? std::sqrt(double(reverse.counts[i])) : 1.0));
+        const float distance = (reverse.meanTargets.col(i) - vertices.segment<3>(3 * reverse.vertices[i]).cast<float>()).norm();
+        reverseMatches.entries[i] = { reverse.vertices[i], i, distance, weight };
+    }
+    std::cout << "Reverse matches: " << numPoints << " scan points on " << numReverse << " vertices in "
+              << (omp_get_wtime() - t_start) * 1000.0 << " ms" << std::endl;
+}
 
-    std::vector<int> valid_indices;
-    
-    for (int i = 0; i < source.cols(); ++i) {
-        float dist = (source.col(i) - nn_points.col(i)).norm();
-        if (dist <= max_distance) {
-            valid_indices.push_back(i);
-        }
+// 反向对应模式下的一轮优化：先把三角形BVH refit到当前betas的网格，每个扫描点在max_distance内找FLAME表面上的最近点，
+// 残差是表面点（三个顶点的重心组合）到扫描点的点到点 + 点到面（三角形法线）
+void solve_with_surface_correspondences(FlameSurfaceBVH& surface, FlameShapeState& shapeState, const MatrixXf& target,
+                                        float max_distance, double weight_p2point, double weight_p2plane, double lambda,
+                                        int activeBetas) {
+    double t_start = omp_get_wtime();
+    surface.update(shapeState.update(shapeParameters));
+    const std::vector<SurfaceMatch> matches = surface.closest_points(target, max_distance);
+    int numMatched = 0;
+    double sumDistance = 0.0;
+    for (const auto& m : matches) {
+        if (m.face < 0) continue;
+        ++numMatched;
+        sumDistance += std::sqrt(m.squaredDistance);
     }
-    
-    // Create filtered matrices with only valid points
-    MatrixXf filtered_source(3, valid_indices.size());
-    MatrixXf filtered_nn_points(3, valid_indices.size());
-    
-    for (int i = 0; i < valid_indices.size(); ++i) {
-        filtered_source.col(i) = source.col(valid_indices[i]);
-        filtered_nn_points.col(i) = nn_points.col(valid_indices[i]);
+    convergence.record_matches(sumDistance / std::max(numMatched, 1), numMatched);
+    std::cout << "Matched " << numMatched << " of " << matches.size() << " scan points to the FLAME surface in "
+              << (omp_get_wtime() - t_start) * 1000.0 << " ms" << std::endl;
+
+    if (USE_NORMAL_EQUATIONS) {
+        t_start = omp_get_wtime();
+        ShapeNormalEquations eq(numShapeParameters);
+        add_surface_normal_equations(eq, shapeModel, surface, matches, target, weight_p2point, weight_p2plane, activeBetas);
+        eq.JtJ.diagonal().array() += lambda;
+        if (!solve_shape_normal_equations(eq, shapeParameters, activeBetas)) {
+            throw std::runtime_error("Normal equations are not solvable in iteration " + std::to_string(ITERATION));
+        }
+        std::cout << "Solved normal equations in " << (omp_get_wtime() - t_start) * 1000.0 << " ms" << std::endl;
+        return;
     }
 
-    // for (auto i : flame_indices){
-    //     std::cout << "flame_indices[i]: " << i << std::endl;
-    // }
-
-    KNN_Result knn_result;
-    knn_result.source = filtered_source;
-    knn_result.nn_points = filtered_nn_points;
-    knn_result.flame_indices = valid_indices;
+    ceres::Problem problem;
+    problem.AddParameterBlock(shapeParameters.data(), numShapeParameters);
+    for (int q = 0; q < int(matches.size()); ++q) {
+        const int f = matches[q].face;
+        if (f < 0) continue;
+        Eigen::Vector3d templateVertices[3];
+        const double* shapeDirRows[3];
+        for (int k = 0; k < 3; ++k) {
+            templateVertices[k] = shapeModel.template_vertex(faces[f][k]);
+            shapeDirRows[k] = shapeModel.shape_dir_rows(faces[f][k]);
+        }
+        problem.AddResidualBlock(
+            new SurfacePointAnalyticCost(templateVertices, shapeDirRows, matches[q].barycentric.cast<double>(), numShapeParameters,
+                                         target.col(q).data(), surface.face_normal(f).cast<double>(),
+                                         weight_p2point, weight_p2plane),
+            nullptr, shapeParameters.data());
+    }
+    problem.AddResidualBlock(new RegularizationAnalyticCost(lambda, numShapeParameters), nullptr, shapeParameters.data());
+    if (SETTINGS.useBetaStages) restrict_to_leading_betas(problem, shapeParameters.data(), numShapeParameters, activeBetas);
+
+    ceres::Solver::Options opts;
+    opts.trust_region_strategy_type  = ceres::LEVENBERG_MARQUARDT;
+    opts.minimizer_progress_to_stdout = 1;
+    opts.num_threads                  = 8;
+    opts.max_num_iterations           = convergence.max_inner_iterations();
+
+    ceres::Solver::Summary summary;
+    solverPolicy.solve(opts, problem, lambda, shapeParameters, &summary);
+    std::cout << summary.BriefReport() << std::endl;
+}
 
-    return knn_result;
+void save_betas(const std::string& file_number, const std::string& name) {
+    std::ofstream betaFile("../model/mesh/" + file_number + "/" + "betas/" + name + ".txt");
+    for (double b : shapeParameters) betaFile << b << "\n";
+    betaFile.close();
+    std::cout << "Saved shape parameters to betas/" + file_number + "/" + name + ".txt\n";
 }
 
+// 每轮存 betas/<轮次>.txt；收敛后再存 betas/final.txt 和实际跑的轮数 betas/rounds.txt，
+// 提前停的时候最后一轮不是固定的编号，read_flame 读这两个文件
+void save_final_betas(const std::string& file_number, int rounds) {
+    save_betas(file_number, "final");
+    std::ofstream roundsFile("../model/mesh/" + file_number + "/" + "betas/rounds.txt");
+    roundsFile << rounds << "\n";
+}
 
 int main() {
     // ------- 1 准备工作 ------- 
@@ -359,54 +334,67 @@ int main() {
     // Load target point cloud (transformed points)
     MatrixXf target = load_off_as_matrix(input_off);
 
+    // 目标点云不变，对应点搜索结构（KD树 / 有序深度网格）只建一次，之后每一轮都复用
+    const std::string input_grid = "../model/mesh/" + file_number + "/organized_" + file_number + ".grid";
+    CorrespondenceEngine correspondences(SETTINGS.correspondenceMode, target, input_grid, PROJECTIVE_WINDOW_RADIUS);
+    if (!correspondences.enable_warm_start(SETTINGS.warmStartSlack) && SETTINGS.warmStartSlack > 0.0f)
+        std::cout << "Warm start needs KDTree mode; every round searches in full." << std::endl;
+    correspondences.set_simd_level(SETTINGS.bruteForceSimd);
+    if (NORMAL_FILTER_CANDIDATES > 1) correspondences.enable_normal_filter(NORMAL_FILTER_CANDIDATES, NORMAL_FILTER_MAX_ANGLE);
+
     const std::string flameModel  = "../model/FLAME2023/face_only_mesh.npz";
-    auto vTpl  = cnpy::npz_load(flameModel, "v_template");
-    auto sDirs  = cnpy::npz_load(flameModel, "shapedirs");
-    auto fArr   = cnpy::npz_load(flameModel, "f");
+    // 一次读入整个 npz（v_template、shapedirs、f 并行解压到最终的缓冲区）
+    shapeModel = FlameModel::load(flameModel);
 
-    numVertices        = int(vTpl.shape[0]);
-    numShapeParameters = int(sDirs.shape[2]);
-    numFaces           = int(fArr.shape[0]);
+    numVertices        = shapeModel.numVertices;
+    numShapeParameters = shapeModel.numShapeParameters;
+    numFaces           = int(shapeModel.faces.size());
 
     // ------- 2 初始化 ------- 
     std::cout << "initializing the parameters...";
-    // 2.1 初始化模板顶点（double）
-    templateVertices.resize(numVertices, 3);
-    const double* vtpl_data = vTpl.data<double>();
+    // 2.3 初始化betas参数
+    shapeParameters.assign(numShapeParameters, 0.0);
 
-    for (int i = 0; i < numVertices; ++i) {
-        templateVertices(i, 0) = vtpl_data[i * 3 + 0];  // x
-        templateVertices(i, 1) = vtpl_data[i * 3 + 1];  // y
-        templateVertices(i, 2) = vtpl_data[i * 3 + 2];  // z
+    // 2.4 初始化faces
+    faces = shapeModel.faces;
+
+
+    // 2.5 顶点缓存，每轮只按 betas 的变化量增量更新
+    FlameShapeState shapeState(shapeModel, SHAPE_DELTA_THRESHOLD, SHAPE_REANCHOR_INTERVAL);
+
+    // 2.6 每顶点Gram缓存（只建一次，之后每轮复用）
+    ShapeGramCache gramCache;
+    if (USE_NORMAL_EQUATIONS && USE_GRAM_CACHE) {
+        gramCache = build_shape_gram_cache(shapeModel);
     }
 
-    // 2.2 初始化形变方向
-    shapeDirections.resize(numVertices * 3 * numShapeParameters);
-    const double* sdir_data = sDirs.data<double>();
-    for (int v = 0; v < numVertices; ++v) {
-        for (int c = 0; c < 3; ++c) {  // 0: x, 1: y, 2: z
-            for (int b = 0; b < numShapeParameters; ++b) {
-                // 3D 到扁平化索引：FLAME 风格展开成 V*3 行 × B 列
-                int flatIndex = (v * 3 + c) * numShapeParameters + b;
-                int npyIndex = v * 3 * numShapeParameters + c * numShapeParameters + b;
-
-                shapeDirections[flatIndex] = sdir_data[npyIndex];
-            }
-        }
+    // 2.7 目标点云的截断距离场（只建一次），USE_DISTANCE_FIELD 时代替每轮的knn
+    std::unique_ptr<TargetDistanceField> distanceField;
+    if (USE_DISTANCE_FIELD) {
+        double t_start = omp_get_wtime();
+        distanceField.reset(new TargetDistanceField(target, DISTANCE_FIELD_RESOLUTION, DISTANCE_FIELD_BAND));
+        std::cout << "Built distance field with " << distanceField->num_blocks() << " blocks in "
+                  << (omp_get_wtime() - t_start) * 1000.0 << " ms" << std::endl;
     }
 
-    // 2.3 初始化betas参数
-    shapeParameters.assign(numShapeParameters, 0.0);
 
-    // 2.4 初始化faces
-    int* f_data = fArr.data<int>();  // npz 中 f 应当是 int32
-    faces.resize(numFaces);
-    for (int i = 0; i < numFaces; ++i) {
-        faces[i] = Eigen::Vector3i(
-            f_data[3*i+0],
-            f_data[3*i+1],
-            f_data[3*i+2]
-        );
+    // 2.8 FLAME顶点的BVH（对称模式的反向匹配用，第一次建树，之后每轮只refit）
+    FlameVertexBVH vertexIndex;
+
+    // 2.8.1 每轮的对应点（只存顶点和目标点的序号，缓冲区跨轮复用）
+    CorrespondenceBuffer matches;
+    ReverseMatches reverse;
+    CorrespondenceBuffer reverseMatches;
+
+    // 2.9 FLAME三角形的BVH（拓扑不变，第一次建树，之后每轮只refit），USE_SURFACE_CORRESPONDENCES 时用
+    FlameSurfaceBVH surface(faces);
+
+
+    // 2.10 ceres 模式下跨轮复用的问题（每轮只更新槽位缓冲区，batched 时批量残差块只在匹配数变化时重建）
+    std::unique_ptr<PersistentShapeProblem> persistentProblem;
+    if (!USE_NORMAL_EQUATIONS) {
+        persistentProblem.reset(new PersistentShapeProblem(shapeModel, shapeParameters.data(), USE_SYMMETRIC_CORRESPONDENCES ? 2 : 1,
+                                                           BATCHED_CERES_COST));
     }
 
 
@@ -416,96 +404,125 @@ int main() {
     double lambda = 1e-5;
     float max_distance = 0.005f;//2mm
 
-    while(ITERATION <= MAX_ITERATION){  
-        
+    std::string stopReason;
+    while(!convergence.converged(&stopReason)){  
+        const std::vector<double> previousBetas = shapeParameters; // 用来判断这一轮betas变了多少
+        const int activeBetas = SETTINGS.active_betas(ITERATION, numShapeParameters); // 由粗到细模式下这一轮只解前 activeBetas 个betas，从上一轮的解开始
+        const bool finalStage = activeBetas == numShapeParameters;
+        if (SETTINGS.useBetaStages) std::cout << "Solving for the first " << activeBetas << " of " << numShapeParameters << " betas" << std::endl;
+
+        if (USE_DISTANCE_FIELD) {
+            // 距离场模式：没有knn，直接在距离场上优化这一轮
+            std::cout << "now start with "<< ITERATION << "-th iteration of distance field optimization.";
+            weight_p2plane += 0.1;
+            lambda -= 1e-6;
+            solve_with_distance_field(*distanceField, weight_p2plane, lambda, activeBetas);
+            save_betas(file_number, std::to_string(ITERATION));
+            convergence.record_update(previousBetas, shapeParameters, finalStage);
+            ITERATION ++;
+            continue;
+        }
+
+        if (USE_SURFACE_CORRESPONDENCES) {
+            // 反向对应模式：扫描点 → FLAME表面
+            std::cout << "now start with "<< ITERATION << "-th iteration of surface correspondences.";
+            weight_p2point += 0.1;
+            weight_p2plane += 0.1;
+            lambda -= 1e-6;
+            solve_with_surface_correspondences(surface, shapeState, target, max_distance, weight_p2point, weight_p2plane, lambda,
+                                               activeBetas);
+            save_betas(file_number, std::to_string(ITERATION));
+            convergence.record_update(previousBetas, shapeParameters, finalStage);
+            ITERATION ++;
+            continue;
+        }
+
         // ------- 3 knn ------- 
         std::cout << "now start with "<< ITERATION << "-th iteration of knn.";
 
         // 3.1 knn(vTpl,sDirs,shapeParameters)
-        Flame_Mesh mesh(vTpl,sDirs,shapeParameters);
-        KNN_Result knn_result = knn(mesh, target, max_distance);
-
-        std::cout << "dimensions of source : " << knn_result.source.cols() << std::endl;
-        std::cout << "dimensions of nn_points : " << knn_result.nn_points.cols() << std::endl;
-        
-        // 3.2 update indexList, matchedTargets
-        Eigen::MatrixXd matchedTargets = knn_result.nn_points.cast<double>();
-        indexList = knn_result.flame_indices;
+        // 前几轮网格离扫描还远，近似搜索就够了，eps按轮次收紧，最后几轮精确
+        const int numScheduled = int(sizeof(APPROXIMATE_EPS_SCHEDULE) / sizeof(APPROXIMATE_EPS_SCHEDULE[0]));
+        correspondences.set_eps(ITERATION <= numScheduled ? APPROXIMATE_EPS_SCHEDULE[ITERATION - 1] : 0.0f);
+        Flame_Mesh mesh(shapeState, shapeParameters);
+        knn(mesh, target, correspondences, max_distance,
+            USE_SYMMETRIC_CORRESPONDENCES ? float(SYMMETRIC_FORWARD_WEIGHT) : 1.0f, matches);
+        std::cout << "number of matches : " << matches.size() << std::endl;
+        convergence.record_matches(matches.mean_distance(), matches.size());
+
+        // 3.2 对称模式：再加扫描点 → 最近FLAME顶点的反向匹配
+        if (USE_SYMMETRIC_CORRESPONDENCES) {
+            find_reverse_matches(vertexIndex, shapeState.vertices(), target, max_distance, reverse, reverseMatches);
+        }
 
 
         // ------- 4 optimization process -------   
         std::cout << "now start with "<< ITERATION << "-th iteration of optimization.";
 
-        // 4.1 构造 Ceres 问题
-        ceres::Problem problem;
-        problem.AddParameterBlock(shapeParameters.data(), numShapeParameters);
-
-        // 4.2 初始化三个权重
+        // 4.1 初始化三个权重
         weight_p2point += 0.1;
         weight_p2plane += 0.1;
          // lambda越大，每次可变空间越小
         lambda -= 1e-6;
 
-        // 4.3 初始化法向量
-        calculateNormals<double>(shapeParameters.data(), vertex_normals);
-
-
-        // 4.4 添加loss
-        for (int i = 0; i < indexList.size(); ++i) { // i是matched targets的index； vi是flame的index
-
-            int vi = indexList[i];
-
-            // P2Point loss
-            auto* cost_p2p = new ceres::DynamicAutoDiffCostFunction<P2PointResidual>(
-                new P2PointResidual(vi, matchedTargets.col(i).eval(), weight_p2point)
-            );
-            cost_p2p->AddParameterBlock(numShapeParameters);
-            cost_p2p->SetNumResiduals(3);
-            problem.AddResidualBlock(cost_p2p, nullptr, shapeParameters.data());
-
-
-            // P2Plane loss
-            auto* cost_p2pl = new ceres::DynamicAutoDiffCostFunction<P2PlaneResidual>(
-                new P2PlaneResidual(vi, matchedTargets.col(i).eval(), vertex_normals[vi], weight_p2plane)
-            );
-            cost_p2pl->AddParameterBlock(numShapeParameters);
-            cost_p2pl->SetNumResiduals(1);
-            problem.AddResidualBlock(cost_p2pl, nullptr, shapeParameters.data());
-
+        // 4.2 初始化法向量（法线过滤时knn里已经按同一组顶点算过）
+        if (!correspondences.normal_filter_enabled()) calculateNormals(shapeState.vertices(), vertex_normals);
+
+        if (USE_NORMAL_EQUATIONS) {
+            // 4.3 直接组装法方程，一次 Cholesky 求解
+            double t_start = omp_get_wtime();
+            // Gram缓存要求所有匹配的点到点权重相同，对称模式下每个匹配有自己的权重，直接组装
+            // 粗阶段只组装左上角 activeBetas x activeBetas 的块，直接组装比用完整的Gram缓存便宜
+            ShapeNormalEquations eq = USE_GRAM_CACHE && !USE_SYMMETRIC_CORRESPONDENCES && finalStage
+                ? assemble_shape_normal_equations_cached(
+                      gramCache, shapeModel, matches, vertex_normals, weight_p2point, weight_p2plane, lambda)
+                : assemble_shape_normal_equations(
+                      shapeModel, matches, vertex_normals, weight_p2point, weight_p2plane, lambda, activeBetas);
+            if (USE_SYMMETRIC_CORRESPONDENCES) {
+                add_shape_normal_equations(eq, shapeModel, reverseMatches, vertex_normals, weight_p2point, weight_p2plane, activeBetas);
+            }
+            if (!solve_shape_normal_equations(eq, shapeParameters, activeBetas)) {
+                throw std::runtime_error("Normal equations are not solvable in iteration " + std::to_string(ITERATION));
+            }
+            std::cout << "Solved normal equations in " << (omp_get_wtime() - t_start) * 1000.0 << " ms" << std::endl;
+        } else {
+            // 4.3 ceres 问题只建一次（2.10），这一轮只改写槽位：正向匹配是第 0 组，反向匹配是第 1 组
+            double t_start = omp_get_wtime();
+            persistentProblem->begin_round(lambda);
+            persistentProblem->set_matches(0, matches, vertex_normals, weight_p2point, weight_p2plane);
+            if (USE_SYMMETRIC_CORRESPONDENCES) {
+                persistentProblem->set_matches(1, reverseMatches, vertex_normals, weight_p2point, weight_p2plane);
+            }
+            std::cout << "Updated " << persistentProblem->num_active() << " residual slots in "
+                      << (omp_get_wtime() - t_start) * 1000.0 << " ms" << std::endl;
+
+
+            // 4.6 求解
+            // 优化器设置是直接照抄exercise5里的设置
+            ceres::Solver::Options opts;
+            opts.trust_region_strategy_type  = ceres::LEVENBERG_MARQUARDT;
+            opts.use_nonmonotonic_steps       = true;
+            opts.minimizer_progress_to_stdout = 1;
+            opts.num_threads                  = 8;
+            opts.max_num_iterations           = convergence.max_inner_iterations();
+
+            if (SETTINGS.useBetaStages) persistentProblem->set_active_betas(activeBetas);
+            ceres::Solver::Summary summary;
+            solverPolicy.solve(opts, persistentProblem->problem(), lambda, shapeParameters, &summary);
+            std::cout << summary.FullReport() << std::endl;
         }
 
 
-        // 4.5 添加正则约束束缚形变大小
-        auto* regCost = new RegularizationCost(lambda, numShapeParameters);
-        auto* regFunc = new ceres::DynamicAutoDiffCostFunction<RegularizationCost>(regCost);
-        regFunc->AddParameterBlock(numShapeParameters);
-        regFunc->SetNumResiduals(numShapeParameters);
-        problem.AddResidualBlock(regFunc, nullptr, shapeParameters.data());
-
-
-        // 4.6 求解
-        // 优化器设置是直接照抄exercise5里的设置
-        ceres::Solver::Options opts;
-        opts.trust_region_strategy_type  = ceres::LEVENBERG_MARQUARDT;
-        opts.use_nonmonotonic_steps       = true;
-        opts.linear_solver_type           = ceres::DENSE_QR;
-        opts.minimizer_progress_to_stdout = 1;
-        opts.num_threads                  = 8;
-        // opts.max_num_iterations           =;
-
-        ceres::Solver::Summary summary;
-        ceres::Solve(opts, &problem, &summary);
-        std::cout << summary.FullReport() << std::endl;
-
-
         //  ------- 5 保存betas ------- 
-        std::ofstream betaFile("../model/mesh/" + file_number + "/" + "betas/" + std::to_string(ITERATION) + ".txt");
-        for (double b : shapeParameters) betaFile << b << "\n";
-        betaFile.close();
-        std::cout << "Saved shape parameters to betas/" + file_number + "/" + std::to_string(ITERATION) + ".txt\n";
+        save_betas(file_number, std::to_string(ITERATION));
 
+        // 近似搜索的轮次和只解部分betas的轮次一样不算最终的问题：不会因为停滞提前停，第一轮精确搜索重新记距离基准，
+        // 所以最后的betas一定来自精确的对应点
+        convergence.record_update(previousBetas, shapeParameters, finalStage && !correspondences.approximate());
         ITERATION ++;
     }
+    std::cout << "Stopped after " << convergence.rounds() << " rounds: " << stopReason << std::endl;
+    save_final_betas(file_number, convergence.rounds());
 
 
     return 0;
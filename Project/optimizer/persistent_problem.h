@@ -0,0 +1,304 @@
+#pragma once
+
+// 跨 ICP 轮复用的 ceres 问题
+// 每轮的对应点不同，但残差的结构不变：每个 FLAME 顶点最多一个匹配（对称模式下正反两组各一个），
+// 雅可比永远是它自己的 S_v。所以问题只建一次：每组给每个顶点一个固定的残差块，残差块按槽位号去读
+// 可变的槽位缓冲区（目标点、顶点法线、两项权重、是否活跃）。每轮只改写槽位和 λ 再求解，
+// 不再重新 new / delete 上万个残差块。没匹配上的顶点槽位不活跃，残差和雅可比都是 0。
+// batched 时只有活跃槽位合成一个残差块（BatchedMatchCost），一次 Evaluate 算完全部残差和雅可比；
+// 每轮把活跃槽位压紧成一张表，残差块的行数就是活跃匹配数，个数变了才重建这一个残差块。
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <Eigen/Dense>
+#include <omp.h>
+#include <ceres/ceres.h>
+#include "flame_model.h"
+#include "flame_costs.h"
+#include "correspondence_buffer.h"
+#include "beta_stages.h"
+
+struct MatchSlot {
+    const float* target = nullptr; // 匹配到的目标点（指向目标点云那一列），不拥有
+    Eigen::Vector3d normal = Eigen::Vector3d::Zero();
+    double weightPoint = 0.0;
+    double weightPlane = 0.0;
+    bool active = false;
+};
+
+// 一个槽位的点到点 + 点到面残差：r = [w_p (p_v - q); w_n nᵀ(p_v - q)]，p_v = t_v + S_v β
+class MatchSlotCost : public ceres::CostFunction {
+public:
+    MatchSlotCost(const Eigen::Vector3d& templateVertex, const double* shapeDirRows, int numShapeParameters,
+                  const std::vector<MatchSlot>& slots, int slot)
+      : templateVertex_(templateVertex), shapeDirRows_(shapeDirRows), numShapeParameters_(numShapeParameters),
+        slots_(slots), slot_(slot) {
+        set_num_residuals(4);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        const MatchSlot& s = slots_[slot_];
+        const bool wantJacobian = jacobians != nullptr && jacobians[0] != nullptr;
+        if (!s.active) {
+            Eigen::Map<Eigen::Vector4d>(residuals).setZero();
+            if (wantJacobian) Eigen::Map<RowMatrixXd>(jacobians[0], 4, numShapeParameters_).setZero();
+            return true;
+        }
+
+        Eigen::Map<const RowMatrixXd> S(shapeDirRows_, 3, numShapeParameters_);
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], numShapeParameters_);
+        const Eigen::Vector3d e = templateVertex_ + S * betas - Eigen::Map<const Eigen::Vector3f>(s.target).cast<double>();
+        Eigen::Map<Eigen::Vector3d> r(residuals);
+        r = s.weightPoint * e;
+        residuals[3] = s.weightPlane * s.normal.dot(e);
+
+        if (wantJacobian) {
+            Eigen::Map<RowMatrixXd> J(jacobians[0], 4, numShapeParameters_);
+            J.topRows(3) = s.weightPoint * S;
+            J.row(3) = s.weightPlane * (s.normal.transpose() * S);
+        }
+        return true;
+    }
+
+private:
+    Eigen::Vector3d templateVertex_;
+    const double* shapeDirRows_; // 指向 shapeDirections 中第 vi*3 行，不拥有
+    int numShapeParameters_;
+    const std::vector<MatchSlot>& slots_;
+    int slot_;
+};
+
+// 一轮里活跃的槽位，压紧成连续的表（PersistentShapeProblem 每轮整理一次）
+// 用到的顶点去重后，它们的 S_v 行和 t_v 按顺序拷进连续的 shapeRows / templateRows，
+// 两组槽位匹配到同一个顶点时共用同一段行
+struct ActiveMatchRows {
+    std::vector<int> slots;       // 活跃槽位号，升序
+    std::vector<int> vertexRow;   // 每个活跃槽位的顶点在 shapeRows 里是第几个（每个顶点 3 行）
+    RowMatrixXd shapeRows;        // 3U x B，U 是用到的顶点数
+    Eigen::VectorXd templateRows; // 3U
+};
+
+// 所有活跃槽位的残差合成一个残差块：第 i 个活跃槽位占第 4i..4i+3 行，没匹配上的顶点不占行
+// 逐块评估时 ceres 要给每个匹配单独调用、单独记账，再把每块 4 x B 的雅可比拷进大矩阵；这里一次调用
+// 就把整个雅可比按行主序连续写完，槽位之间用 OpenMP 并行。
+// 只要残差（线搜索、试探步）时，先把用到的顶点的位置一起算出来
+//     p = t_U + S_U β,  S_U 是压紧后的 3U x B
+// （按行分块并行，就是一次 GEMV，两组槽位共用）；要雅可比时 S_v 反正要读，
+// 就在写雅可比的同时算 S_v β，每个 S_v 只读一遍。
+// 行数在构造时定下，活跃槽位个数变了要重建残差块（PersistentShapeProblem 负责）
+class BatchedMatchCost : public ceres::CostFunction {
+public:
+    static constexpr int ROW_CHUNK = 256; // GEMV 每块的行数
+
+    BatchedMatchCost(int numShapeParameters, const std::vector<MatchSlot>& slots, const ActiveMatchRows& active)
+      : numShapeParameters_(numShapeParameters), numActive_(int(active.slots.size())), slots_(slots), active_(active) {
+        set_num_residuals(4 * numActive_);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        const int B = numShapeParameters_;
+        if (int(active_.slots.size()) != numActive_) return false; // 活跃槽位变了但残差块没重建
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], B);
+        const bool wantJacobian = jacobians != nullptr && jacobians[0] != nullptr;
+
+        if (wantJacobian) {
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < numActive_; ++i) {
+                const MatchSlot& s = slots_[active_.slots[i]];
+                const int row = 3 * active_.vertexRow[i];
+                Eigen::Map<Eigen::Vector4d> r(residuals + 4 * size_t(i));
+                Eigen::Map<RowMatrixXd> J(jacobians[0] + 4 * size_t(i) * B, 4, B);
+                const auto S = active_.shapeRows.middleRows<3>(row);
+                J.topRows(3) = s.weightPoint * S;
+                J.row(3) = s.weightPlane * (s.normal.transpose() * S);
+                const Eigen::Vector3d e = active_.templateRows.segment<3>(row) + S * betas
+                                        - Eigen::Map<const Eigen::Vector3f>(s.target).cast<double>();
+                r.head<3>() = s.weightPoint * e;
+                r(3) = s.weightPlane * s.normal.dot(e);
+            }
+            return true;
+        }
+
+        const int rows = int(active_.shapeRows.rows());
+        Eigen::VectorXd positions(rows);
+        #pragma omp parallel for schedule(static)
+        for (int start = 0; start < rows; start += ROW_CHUNK) {
+            const int count = std::min(ROW_CHUNK, rows - start);
+            positions.segment(start, count).noalias() = active_.shapeRows.middleRows(start, count) * betas;
+            positions.segment(start, count) += active_.templateRows.segment(start, count);
+        }
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < numActive_; ++i) {
+            const MatchSlot& s = slots_[active_.slots[i]];
+            Eigen::Map<Eigen::Vector4d> r(residuals + 4 * size_t(i));
+            const Eigen::Vector3d e = positions.segment<3>(3 * active_.vertexRow[i]) - Eigen::Map<const Eigen::Vector3f>(s.target).cast<double>();
+            r.head<3>() = s.weightPoint * e;
+            r(3) = s.weightPlane * s.normal.dot(e);
+        }
+        return true;
+    }
+
+private:
+    int numShapeParameters_;
+    int numActive_;
+    const std::vector<MatchSlot>& slots_;
+    const ActiveMatchRows& active_;
+};
+
+// β 的正则化残差项，λ 从外面读，每轮可以改：r = sqrt(λ) β
+class MutableRegularizationCost : public ceres::CostFunction {
+public:
+    MutableRegularizationCost(const double& lambda, int numShapeParameters)
+      : lambda_(lambda), numShapeParameters_(numShapeParameters) {
+        set_num_residuals(numShapeParameters);
+        mutable_parameter_block_sizes()->push_back(numShapeParameters);
+    }
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        const double sqrtLambda = std::sqrt(lambda_);
+        Eigen::Map<const Eigen::VectorXd> betas(parameters[0], numShapeParameters_);
+        Eigen::Map<Eigen::VectorXd>(residuals, numShapeParameters_) = sqrtLambda * betas;
+
+        if (jacobians != nullptr && jacobians[0] != nullptr) {
+            Eigen::Map<RowMatrixXd> J(jacobians[0], numShapeParameters_, numShapeParameters_);
+            J.setZero();
+            J.diagonal().setConstant(sqrtLambda);
+        }
+        return true;
+    }
+
+private:
+    const double& lambda_;
+    int numShapeParameters_;
+};
+
+class PersistentShapeProblem {
+public:
+    // numGroups 组匹配，每组每个顶点一个槽位（第 g 组顶点 v 的槽位是 g * V + v）
+    // batched: 活跃槽位一个残差块（BatchedMatchCost，第一轮有匹配时才加进问题）；否则每个槽位一个 MatchSlotCost
+    PersistentShapeProblem(const FlameModel& model, double* betas, int numGroups = 1, bool batched = true)
+      : model_(model), numVertices_(model.numVertices), numShapeParameters_(model.numShapeParameters),
+        activeBetas_(model.numShapeParameters), batched_(batched), betas_(betas), slots_(size_t(numGroups) * model.numVertices),
+        rowOfVertex_(model.numVertices, -1) {
+        const int B = model.numShapeParameters;
+        problem_.AddParameterBlock(betas_, B);
+        if (!batched) {
+            for (int slot = 0; slot < int(slots_.size()); ++slot) {
+                const int vi = slot % numVertices_;
+                problem_.AddResidualBlock(new MatchSlotCost(model.template_vertex(vi), model.shape_dir_rows(vi), B, slots_, slot),
+                                          nullptr, betas_);
+            }
+        }
+        problem_.AddResidualBlock(new MutableRegularizationCost(lambda_, B), nullptr, betas_);
+    }
+
+    PersistentShapeProblem(const PersistentShapeProblem&) = delete;
+    PersistentShapeProblem& operator=(const PersistentShapeProblem&) = delete;
+
+    // 新的一轮：所有槽位先置为不活跃
+    void begin_round(double lambda) {
+        lambda_ = lambda;
+        for (MatchSlot& s : slots_) s.active = false;
+        dirty_ = true;
+    }
+
+    // 把一组匹配写进第 group 组槽位，每个匹配的两项权重再乘它自己的 weight
+    void set_matches(int group, const CorrespondenceBuffer& matches, const std::vector<Eigen::Vector3d>& vertexNormals,
+                     double weightPoint, double weightPlane) {
+        if (group < 0 || (group + 1) * size_t(numVertices_) > slots_.size())
+            throw std::runtime_error("Persistent problem has no match group " + std::to_string(group));
+        for (int i = 0; i < matches.size(); ++i) {
+            const int vi = matches[i].flameIndex;
+            MatchSlot& s = slots_[size_t(group) * numVertices_ + vi];
+            if (s.active) throw std::runtime_error("Vertex " + std::to_string(vi) + " matched twice in group " + std::to_string(group));
+            s.target = matches.target(i);
+            s.normal = vertexNormals[vi];
+            s.weightPoint = matches[i].weight * weightPoint;
+            s.weightPlane = matches[i].weight * weightPlane;
+            s.active = true;
+        }
+        dirty_ = true;
+    }
+
+    // 由粗到细：只让前 numActive 个 betas 参与优化。只在个数变化时重设 manifold，
+    // 否则每轮都会多一个 problem 拥有的 SubsetManifold，ceres 也要每轮重新整理参数块
+    void set_active_betas(int numActive) {
+        numActive = std::min(numActive, numShapeParameters_);
+        if (numActive == activeBetas_) return;
+        if (numActive == numShapeParameters_) problem_.SetManifold(betas_, nullptr);
+        else restrict_to_leading_betas(problem_, betas_, numShapeParameters_, numActive);
+        activeBetas_ = numActive;
+    }
+
+    int num_active() const {
+        int n = 0;
+        for (const MatchSlot& s : slots_) n += s.active;
+        return n;
+    }
+
+    // 求解前取问题：batched 时先把这一轮的活跃槽位压紧（见 compact_active_slots）
+    ceres::Problem& problem() {
+        if (batched_ && dirty_) compact_active_slots();
+        return problem_;
+    }
+
+private:
+    // 把活跃槽位整理进 active_，拷贝用到的顶点的 S_v / t_v；活跃个数变了就删掉旧的批量残差块、按新行数重建，
+    // 这样问题里没有全 0 的补位行（ceres 的行数、线性求解器的选择都只看真实匹配）
+    void compact_active_slots() {
+        const int B = numShapeParameters_;
+        active_.slots.clear();
+        active_.vertexRow.clear();
+        std::vector<int> vertices;
+        for (int slot = 0; slot < int(slots_.size()); ++slot) {
+            if (!slots_[slot].active) continue;
+            const int vi = slot % numVertices_;
+            if (rowOfVertex_[vi] < 0) {
+                rowOfVertex_[vi] = int(vertices.size());
+                vertices.push_back(vi);
+            }
+            active_.slots.push_back(slot);
+            active_.vertexRow.push_back(rowOfVertex_[vi]);
+        }
+
+        const int numUsed = int(vertices.size());
+        active_.shapeRows.resize(3 * numUsed, B);
+        active_.templateRows.resize(3 * numUsed);
+        #pragma omp parallel for schedule(static)
+        for (int u = 0; u < numUsed; ++u) {
+            active_.shapeRows.middleRows<3>(3 * u) = Eigen::Map<const RowMatrixXd>(model_.shape_dir_rows(vertices[u]), 3, B);
+            active_.templateRows.segment<3>(3 * u) = model_.template_vertex(vertices[u]);
+        }
+        for (int vi : vertices) rowOfVertex_[vi] = -1;
+
+        const int numActive = int(active_.slots.size());
+        if (batchedBlock_ == nullptr || numActive != batchedRows_) {
+            if (batchedBlock_ != nullptr) problem_.RemoveResidualBlock(batchedBlock_);
+            batchedBlock_ = nullptr;
+            if (numActive > 0) batchedBlock_ = problem_.AddResidualBlock(new BatchedMatchCost(B, slots_, active_), nullptr, betas_);
+            batchedRows_ = numActive;
+        }
+        dirty_ = false;
+    }
+
+    const FlameModel& model_;
+    int numVertices_;
+    int numShapeParameters_;
+    int activeBetas_;          // 当前参与优化的 betas 个数（前 activeBetas_ 个）
+    bool batched_;
+    double* betas_;
+    double lambda_ = 0.0;
+    std::vector<MatchSlot> slots_; // 建好之后大小不再变，残差块里存的引用一直有效
+    ActiveMatchRows active_;       // batched 时这一轮压紧后的活跃槽位，批量残差块存的是它的引用
+    std::vector<int> rowOfVertex_; // 压紧时用：顶点 -> 在 active_.shapeRows 里的序号，-1 表示这一轮还没用到
+    bool dirty_ = true;            // 槽位改过、还没重新压紧
+    ceres::ResidualBlockId batchedBlock_ = nullptr;
+    int batchedRows_ = 0;          // batchedBlock_ 里的活跃槽位个数
+    ceres::Problem problem_;
+};
@@ -3,12 +3,14 @@
 #include <string>
 #include <Eigen/Dense>
 #include <fstream>
-#include "cnpy.h"
+#include "flame_model.h"
 #include <random>
 
 // Read flame from npz file and exports to obj file. Generates random face if GENERATE_RANDOM_FACE set to true, generic face otherwise.
 // Generate optimized flame moodel if GENERATE_SPECIFIC_FACE set to true(it will read the optimized betas.txt).
-static const int ITERATION = 7; //用来记录这是第几轮优化（loss+knn算一轮）
+// GENERATE_BATCH exports every saved round of every subject in batch_file_numbers with a single GEMM.
+// optimize_plane can stop early, so the number of rounds comes from betas/rounds.txt and the result
+// of the last round from betas/final.txt.
 
 
 // Save vertices & faces to OBJ
@@ -33,49 +35,89 @@ void save_obj(const std::string& path,
     std::cout << "Exported mesh to " << path << std::endl;
 }
 
+// Read one betas.txt, returns false if the file is missing or has the wrong length
+bool read_betas(const std::string& path, size_t num_betas, std::vector<double>& betas) {
+    betas.clear();
+    std::ifstream betaFile(path);
+    double val;
+    while (betaFile >> val) {
+        betas.push_back(val);
+    }
+    if (betas.size() != num_betas) {
+        std::cerr << "Beta size mismatch in " << path << ": expected " << num_betas << ", got " << betas.size() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Number of rounds optimize_plane ran for a subject (betas/rounds.txt), 0 if it is missing
+int read_rounds(const std::string& betas_dir) {
+    std::ifstream roundsFile(betas_dir + "rounds.txt");
+    int rounds = 0;
+    if (!(roundsFile >> rounds) || rounds < 1) {
+        std::cerr << "Missing or invalid " << betas_dir << "rounds.txt, run optimize_plane first" << std::endl;
+        return 0;
+    }
+    return rounds;
+}
+
 int main() {
     bool GENERATE_RANDOM_FACE = false;
     bool GENERATE_SPECIFIC_FACE = true;
+    bool GENERATE_BATCH = false;
     std::string file_number = "00052";
+    std::vector<std::string> batch_file_numbers = {"00052"};
 
     std::string npz_path = "../model/FLAME2023/flame2023_no_jaw.npz";
 
-    // Load v_template
-    cnpy::NpyArray v_template_arr = cnpy::npz_load(npz_path, "v_template");
-    if (v_template_arr.shape.size() != 2 || v_template_arr.shape[1] != 3) {
-        std::cerr << "Unexpected v_template shape!" << std::endl;
+    // Load v_template, shapedirs and faces in one pass over the archive
+    FlameModel model = FlameModel::load(npz_path);
+    size_t num_vertices = model.numVertices;
+    const std::vector<Eigen::Vector3i>& faces = model.faces;
+    if (faces.empty()) {
+        std::cerr << "No faces in " << npz_path << std::endl;
         return 1;
     }
 
-    size_t num_vertices = v_template_arr.shape[0];
-    const double* v_data = v_template_arr.data<double>();
+    size_t num_betas = model.numShapeParameters;  // should be 400
+    std::cout << "Num of num_betas is " << num_betas << std::endl;
 
-    // Load faces
-    cnpy::NpyArray faces_arr = cnpy::npz_load(npz_path, "faces");
-    if (faces_arr.shape.size() != 2 || faces_arr.shape[1] != 3) {
-        std::cerr << "Unexpected faces shape!" << std::endl;
-        return 1;
-    }
-    size_t num_faces = faces_arr.shape[0];
-    const uint32_t* f_data = faces_arr.data<uint32_t>();
 
-    // Load shapedirs
-    cnpy::NpyArray shapedirs_arr = cnpy::npz_load(npz_path, "shapedirs");
-    if (shapedirs_arr.shape.size() != 3 || shapedirs_arr.shape[1] != 3) {
-        std::cerr << "Unexpected shapedirs shape!" << std::endl;
-        return 1;
-    }
-    size_t num_betas = shapedirs_arr.shape[2];  // should be 400
-    std::cout << "Num of num_betas is " << num_betas << std::endl;
-    const double* s_data = shapedirs_arr.data<double>();
+    // Batch mode: all subjects x all saved rounds in one (3V x B) * (B x N) product
+    if (GENERATE_BATCH) {
+        std::vector<std::string> in_paths, out_paths;
+        for (const auto& fn : batch_file_numbers) {
+            const std::string betas_dir = "../model/mesh/" + fn + "/" + "betas/";
+            const int rounds = read_rounds(betas_dir);
+            if (rounds == 0) return 1;
+            for (int it = 1; it <= rounds; ++it) {
+                in_paths.push_back(betas_dir + std::to_string(it) + ".txt");
+                out_paths.push_back("../model/mesh/" + fn + "/" + std::to_string(it) + ".obj");
+            }
+            in_paths.push_back(betas_dir + "final.txt");
+            out_paths.push_back("../model/mesh/" + fn + "/" + "final.obj");
+        }
+
+        Eigen::MatrixXd batch_betas(num_betas, in_paths.size());
+        std::vector<double> betas;
+        for (size_t m = 0; m < in_paths.size(); ++m) {
+            if (!read_betas(in_paths[m], num_betas, betas)) {
+                return 1;
+            }
+            batch_betas.col(m) = Eigen::Map<const Eigen::VectorXd>(betas.data(), num_betas);
+        }
 
+        Eigen::MatrixXd batch_vertices = compute_shape_vertices_batch(model, batch_betas);
+        std::cout << "Generated " << out_paths.size() << " meshes in one batch." << std::endl;
 
-    //Prepare faces
-    std::vector<Eigen::Vector3i> faces(num_faces);
-    for (size_t i = 0; i < num_faces; ++i) {
-        faces[i] = Eigen::Vector3i(static_cast<int>(f_data[i * 3 + 0]),
-                                   static_cast<int>(f_data[i * 3 + 1]),
-                                   static_cast<int>(f_data[i * 3 + 2]));
+        std::vector<Eigen::Vector3f> vertices(num_vertices);
+        for (size_t m = 0; m < out_paths.size(); ++m) {
+            for (size_t v = 0; v < num_vertices; ++v) {
+                vertices[v] = batch_vertices.col(m).segment<3>(3 * v).cast<float>();
+            }
+            save_obj(out_paths[m], vertices, faces);
+        }
+        return 0;
     }
 
     // Generate random betas
@@ -85,13 +127,7 @@ int main() {
 
     std::vector<double> betas;
     if (GENERATE_SPECIFIC_FACE) {
-        std::ifstream betaFile("../model/mesh/" + file_number + "/" + "betas/" + std::to_string(ITERATION) + ".txt");
-        double val;
-        while (betaFile >> val) {
-            betas.push_back(val);
-        }
-        if (betas.size() != num_betas) {
-            std::cerr << "Beta size mismatch: expected " << num_betas << ", got " << betas.size() << std::endl;
+        if (!read_betas("../model/mesh/" + file_number + "/" + "betas/final.txt", num_betas, betas)) {
             return 1;
         }
         std::cout << "First 10 beta values: ";
@@ -111,40 +147,21 @@ int main() {
     std::cout << "randomface: " << GENERATE_RANDOM_FACE << std::endl;
 
 
-    if(GENERATE_SPECIFIC_FACE == true){
-        for (int i = 0; i < num_vertices; ++i) {
-            Eigen::Vector3d v(v_data[i * 3 + 0],
-                  v_data[i * 3 + 1],
-                  v_data[i * 3 + 2]);
-            for (int k = 0; k < num_betas; ++k) {
-                v[0] += s_data[(i * 3 + 0) * num_betas + k] * betas[k];
-                v[1] += s_data[(i * 3 + 1) * num_betas + k] * betas[k];
-                v[2] += s_data[(i * 3 + 2) * num_betas + k] * betas[k];
-            }
-            vertices[i] = v.cast<float>();
-        }
-
-
-        std::cout << "Generated deformed mesh with specific betas." << std::endl;
-    } else if (GENERATE_RANDOM_FACE == true) {
+    if (GENERATE_SPECIFIC_FACE == true || GENERATE_RANDOM_FACE == true) {
+        // v_shaped = v_template + S * betas, one GEMV over the whole (3V x B) shapedirs
+        Eigen::VectorXd v_shaped = compute_shape_vertices(model, betas);
         for (size_t v = 0; v < num_vertices; ++v) {
-            Eigen::Vector3d v_shaped(v_data[v * 3 + 0],
-                                    v_data[v * 3 + 1],
-                                    v_data[v * 3 + 2]);
-            for (size_t i = 0; i < num_betas; ++i) {
-                v_shaped.x() += s_data[v * 3 * num_betas + 0 * num_betas + i] * betas[i];
-                v_shaped.y() += s_data[v * 3 * num_betas + 1 * num_betas + i] * betas[i];
-                v_shaped.z() += s_data[v * 3 * num_betas + 2 * num_betas + i] * betas[i];
-            }
-            vertices[v] = v_shaped.cast<float>();
+            vertices[v] = v_shaped.segment<3>(3 * v).cast<float>();
+        }
+        if (GENERATE_SPECIFIC_FACE == true) {
+            std::cout << "Generated deformed mesh with specific betas." << std::endl;
+        } else {
+            std::cout << "Generated deformed mesh with random betas." << std::endl;
         }
-        std::cout << "Generated deformed mesh with random betas." << std::endl;
     } else {
     // If random face not enabled, use v_template directly
     for (size_t v = 0; v < num_vertices; ++v) {
-        vertices[v] = Eigen::Vector3f(static_cast<float>(v_data[v * 3 + 0]),
-                                        static_cast<float>(v_data[v * 3 + 1]),
-                                        static_cast<float>(v_data[v * 3 + 2]));
+        vertices[v] = model.template_vertex(v).cast<float>();
         }
         std::cout << "Exporting neutral v_template mesh." << std::endl;
     }
@@ -165,7 +182,7 @@ int main() {
     std::cout << "First 3 points in 3xN matrix (columns 0,1,2):\n";
     std::cout << face_points.block(0, 0, 3, 3) << std::endl;
 
-    save_obj("../model/mesh/" + file_number + "/" + std::to_string(ITERATION) + ".obj", vertices, faces);
+    save_obj("../model/mesh/" + file_number + "/" + (GENERATE_SPECIFIC_FACE ? "final" : GENERATE_RANDOM_FACE ? "random" : "template") + ".obj", vertices, faces);
 
     return 0;
 }
\ No newline at end of file
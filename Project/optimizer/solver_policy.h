@@ -0,0 +1,180 @@
+#pragma once
+
+// ceres 线性求解器的选择
+// 每一步 LM 都要解一次 min ||J δ - r||² + ||D δ||²，J 有几万行、B = 400 列：
+//   DENSE_QR               对 J 做 QR，最稳，但代价约是法方程的两倍，还要拷一份 J
+//   DENSE_NORMAL_CHOLESKY  先算 JᵀJ（400 x 400）再 Cholesky，快，但条件数会平方
+//   CGNR                   共轭梯度解法方程（Jacobi 预条件），每次迭代只做 J v 和 Jᵀ v，
+//                          迭代次数大约是 sqrt(κ)，条件数小的时候比形成 JᵀJ 还便宜
+// Auto 按问题形状和条件数选：κ 太大用 QR；行数不到列数两倍时 QR 和法方程差不多，也用 QR；
+// 4 sqrt(κ) 次 J 乘法比形成 JᵀJ 便宜时用 CGNR；其余用法方程。
+// 条件数只估一个上界：λmax(JᵀJ) 用幂迭代，λmin ≥ λ（问题里总有 sqrt(λ) I 的正则项）。
+// 列数按切空间算（由粗到细时 SubsetManifold 固定住的 betas 不算），行数是真实残差数。
+// λmax 只在活跃列数变化时重新估计（要算一遍完整的雅可比）；λ 每轮都变，所以每次求解都用缓存的 λmax
+// 和这一轮的 λ、行数重新选一次，这一步不花时间。
+// benchmark 打开时每次重新估计 λmax 后，三种求解器从同一个起点各解一遍，打印时间和最终代价，
+// 选最终代价不差（相对 BENCHMARK_COST_TOLERANCE 以内）的里面最快的那个，直到列数再变化。
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <limits>
+#include <iostream>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <omp.h>
+#include <ceres/ceres.h>
+
+enum class LinearSolverChoice { Auto, DenseNormalCholesky, DenseQR, CGNR };
+
+inline ceres::LinearSolverType to_ceres(LinearSolverChoice choice) {
+    switch (choice) {
+        case LinearSolverChoice::DenseNormalCholesky: return ceres::DENSE_NORMAL_CHOLESKY;
+        case LinearSolverChoice::CGNR:                return ceres::CGNR;
+        default:                                      return ceres::DENSE_QR;
+    }
+}
+
+// 问题的切空间维数：所有非常量参数块的切空间大小之和（设了 manifold 的参数块按 manifold 算）
+inline int tangent_columns(const ceres::Problem& problem) {
+    std::vector<double*> blocks;
+    problem.GetParameterBlocks(&blocks);
+    int cols = 0;
+    for (const double* block : blocks) {
+        if (!problem.IsParameterBlockConstant(block)) cols += problem.ParameterBlockTangentSize(block);
+    }
+    return cols;
+}
+
+// λmax(JᵀJ)：iterations 次幂迭代（Jᵀ J v），J 的列已经是切空间的列
+inline double estimate_largest_eigenvalue(ceres::Problem& problem, int iterations = 10) {
+    ceres::CRSMatrix J;
+    ceres::Problem::EvaluateOptions evaluateOptions;
+    evaluateOptions.num_threads = omp_get_max_threads();
+    if (!problem.Evaluate(evaluateOptions, nullptr, nullptr, nullptr, &J) || J.num_cols == 0) return 0.0;
+
+    Eigen::VectorXd v = Eigen::VectorXd::Ones(J.num_cols).normalized();
+    Eigen::VectorXd Jv(J.num_rows);
+    double largest = 0.0;
+    for (int it = 0; it < iterations; ++it) {
+        #pragma omp parallel for schedule(static)
+        for (int r = 0; r < J.num_rows; ++r) {
+            double sum = 0.0;
+            for (int k = J.rows[r]; k < J.rows[r + 1]; ++k) sum += J.values[k] * v(J.cols[k]);
+            Jv(r) = sum;
+        }
+        Eigen::VectorXd JtJv = Eigen::VectorXd::Zero(J.num_cols);
+        for (int r = 0; r < J.num_rows; ++r)
+            for (int k = J.rows[r]; k < J.rows[r + 1]; ++k) JtJv(J.cols[k]) += J.values[k] * Jv(r);
+        largest = JtJv.norm();
+        if (largest == 0.0) break;
+        v = JtJv / largest;
+    }
+    return largest;
+}
+
+// κ(JᵀJ + λI) 的上界：λmin 取 lambda
+inline double condition_bound(double largestEigenvalue, double lambda) {
+    return std::max(1.0, largestEigenvalue / std::max(lambda, 1e-300));
+}
+
+// 按问题形状和条件数上界选
+inline LinearSolverChoice choose_linear_solver(int rows, int cols, double conditionBound) {
+    static const double MAX_CHOLESKY_CONDITION = 1e8; // 法方程把条件数平方，超过这个 Cholesky 只剩不到一半有效位
+    if (conditionBound > MAX_CHOLESKY_CONDITION || rows < 2 * cols) return LinearSolverChoice::DenseQR;
+    if (4.0 * std::sqrt(conditionBound) < cols) return LinearSolverChoice::CGNR;
+    return LinearSolverChoice::DenseNormalCholesky;
+}
+
+class LinearSolverPolicy {
+public:
+    static constexpr double BENCHMARK_COST_TOLERANCE = 1e-6;
+
+    // forced 不是 Auto 时永远用它（benchmark 仍然会跑，只打印不替换）
+    explicit LinearSolverPolicy(LinearSolverChoice forced = LinearSolverChoice::Auto, bool benchmark = false)
+      : forced_(forced), benchmark_(benchmark) {}
+
+    // 用选好的线性求解器解 problem，options 里其它设置不变；params 是问题唯一的参数块（benchmark 时要还原起点）
+    void solve(ceres::Solver::Options options, ceres::Problem& problem, double lambda,
+               std::vector<double>& params, ceres::Solver::Summary* summary) {
+        decide(options, problem, lambda, params);
+        options.linear_solver_type = to_ceres(choice_);
+        if (choice_ == LinearSolverChoice::CGNR) options.preconditioner_type = ceres::JACOBI;
+        ceres::Solve(options, &problem, summary);
+        log(choice_, *summary);
+    }
+
+    LinearSolverChoice choice() const { return choice_; }
+
+private:
+    // 活跃列数变了（第一次求解、由粗到细换阶段）才重新估计 λmax 和跑 benchmark；
+    // 选择本身每次都按这一轮的 λ 和行数重做（benchmark 选出的沿用到列数再变），结果变了才打印
+    void decide(const ceres::Solver::Options& options, ceres::Problem& problem, double lambda, std::vector<double>& params) {
+        const int cols = tangent_columns(problem);
+        const bool newColumns = cols != decidedColumns_;
+        if (forced_ != LinearSolverChoice::Auto) {
+            if (decidedColumns_ < 0)
+                std::cout << "Linear solver forced to " << ceres::LinearSolverTypeToString(to_ceres(forced_)) << std::endl;
+            choice_ = forced_;
+        } else if (benchmark_ && !newColumns) {
+            // 沿用这组列上 benchmark 选出的求解器
+        } else {
+            const double t_start = omp_get_wtime();
+            if (newColumns) largestEigenvalue_ = estimate_largest_eigenvalue(problem);
+            const double condition = condition_bound(largestEigenvalue_, lambda);
+            const LinearSolverChoice choice = choose_linear_solver(problem.NumResiduals(), cols, condition);
+            if (newColumns || choice != choice_) {
+                std::cout << "Linear solver " << ceres::LinearSolverTypeToString(to_ceres(choice)) << " for "
+                          << problem.NumResiduals() << " x " << cols << ", condition bound " << condition
+                          << " at lambda " << lambda;
+                if (newColumns) std::cout << " (estimated in " << (omp_get_wtime() - t_start) * 1000.0 << " ms)";
+                std::cout << std::endl;
+            }
+            choice_ = choice;
+        }
+        decidedColumns_ = cols;
+        if (benchmark_ && newColumns) benchmark(options, problem, params);
+    }
+
+    // 三种求解器从同一个起点各解一遍，起点最后还原
+    void benchmark(ceres::Solver::Options options, ceres::Problem& problem, std::vector<double>& params) {
+        const std::vector<double> start = params;
+        const LinearSolverChoice candidates[] = {
+            LinearSolverChoice::DenseNormalCholesky, LinearSolverChoice::DenseQR, LinearSolverChoice::CGNR };
+        double times[3], costs[3];
+        options.minimizer_progress_to_stdout = false;
+        for (int c = 0; c < 3; ++c) {
+            params = start;
+            options.linear_solver_type = to_ceres(candidates[c]);
+            options.preconditioner_type = ceres::JACOBI;
+            ceres::Solver::Summary summary;
+            ceres::Solve(options, &problem, &summary);
+            times[c] = summary.total_time_in_seconds;
+            costs[c] = summary.IsSolutionUsable() ? summary.final_cost : std::numeric_limits<double>::infinity();
+            log(candidates[c], summary);
+        }
+        params = start;
+
+        const double best = *std::min_element(costs, costs + 3);
+        int fastest = -1;
+        for (int c = 0; c < 3; ++c) {
+            if (costs[c] > best * (1.0 + BENCHMARK_COST_TOLERANCE)) continue;
+            if (fastest < 0 || times[c] < times[fastest]) fastest = c;
+        }
+        std::cout << "Fastest stable linear solver: " << ceres::LinearSolverTypeToString(to_ceres(candidates[fastest])) << std::endl;
+        if (forced_ == LinearSolverChoice::Auto) choice_ = candidates[fastest];
+    }
+
+    static void log(LinearSolverChoice choice, const ceres::Solver::Summary& summary) {
+        std::cout << "Linear solver " << ceres::LinearSolverTypeToString(to_ceres(choice)) << ": "
+                  << summary.total_time_in_seconds * 1000.0 << " ms total, "
+                  << summary.linear_solver_time_in_seconds * 1000.0 << " ms in linear solves, cost "
+                  << summary.initial_cost << " -> " << summary.final_cost << std::endl;
+    }
+
+    LinearSolverChoice forced_;
+    bool benchmark_;
+    int decidedColumns_ = -1;       // 上次选择时的切空间列数，-1 表示还没选过
+    double largestEigenvalue_ = 0.0; // 在 decidedColumns_ 列上估计的 λmax(JᵀJ)
+    LinearSolverChoice choice_ = LinearSolverChoice::DenseQR;
+};